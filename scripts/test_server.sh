@@ -0,0 +1,53 @@
+#!/bin/sh
+# usage: scripts/test_server.sh [main binary], from the root of the repository
+# Runs jobs through the server on stdin, with weights trained for another
+# board size, which the server resizes before it solves, with a weights file
+# rewritten between jobs, and with fewer contexts kept than board sizes.
+set -e
+MAIN=${1:-build/release/main}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# the weights in weights/ are legacy files, without their board size
+"$MAIN" --n 5 --load weights/w5 train --steps 1 --iters 10 --count 100000 --ratio 0.1 \
+  -o "$TMP/w5" >/dev/null 2>&1
+
+printf '%s\n' \
+  "id=1 n=7 width=1000 generate=1 weights=weights/w7" \
+  "id=2 n=7 width=1000 generate=1 weights=$TMP/w5" \
+  "id=3 n=8 width=1000 generate=1 weights=$TMP/w5" \
+  "id=4 n=7 width=1000 generate=2" \
+  | "$MAIN" server > "$TMP/out"
+
+cut -c1-80 "$TMP/out"
+test "$(grep -c ' ok ' "$TMP/out")" -eq 4
+
+solution() {
+  grep "^id=$1 ok" "$2" | sed 's/.*solution=//'
+}
+
+# the same path holds the weights of weights/w7, then those of $TMP/w5
+JOB="n=7 width=1000 generate=3 deterministic=1 threads=1"
+cp weights/w7 "$TMP/w"
+: > "$TMP/out2"
+{
+  echo "id=1 $JOB weights=$TMP/w"
+  while [ "$(wc -l < "$TMP/out2")" -lt 1 ]; do sleep 0.1; done
+  cp "$TMP/w5" "$TMP/w"
+  echo "id=2 $JOB weights=$TMP/w"
+  echo "id=3 $JOB weights=$TMP/w5"
+} | "$MAIN" server > "$TMP/out2"
+cut -c1-80 "$TMP/out2"
+test "$(solution 1 "$TMP/out2")" != "$(solution 2 "$TMP/out2")"
+test "$(solution 2 "$TMP/out2")" = "$(solution 3 "$TMP/out2")"
+
+# a single context, evicted by each change of board size
+printf '%s\n' \
+  "id=1 $JOB" \
+  "id=2 n=8 width=1000 generate=3 deterministic=1 threads=1" \
+  "id=3 $JOB" \
+  | "$MAIN" server --max-contexts 1 > "$TMP/out3"
+cut -c1-80 "$TMP/out3"
+test "$(grep -c ' ok ' "$TMP/out3")" -eq 3
+test "$(solution 1 "$TMP/out3")" = "$(solution 3 "$TMP/out3")"
+echo "ok"
@@ -2,112 +2,135 @@
 #include "puzzle.hpp"
 #include <mutex>
 #include <omp.h>
+#include <pthread.h>
+#include <sched.h>
 
-const u64 HASH_SIZE = 1ull<<28;
-const u64 HASH_MASK = HASH_SIZE-1;
-
-const i64 MIN_TREE_SIZE = 1<<20;
-i64 tree_size = MIN_TREE_SIZE;
-
-mutex bs_mutex;
-
-vector<euler_tour> tree_pool;
+tree_pool_t::~tree_pool_t() {
+  for(auto t : trees) delete[] t.data;
+}
 
-euler_tour get_new_tree(){
+euler_tour tree_pool_t::get(){
   euler_tour tour;
 
-  { lock_guard<mutex> lock(bs_mutex);
-    if(tree_pool.empty()) {
+  { lock_guard<mutex> lock(m);
+    if(trees.empty()) {
       tour.max_size = tree_size;
       tour.size = 0;
-      tour.data = new u8[tree_size];
+      tour.data = new u8[euler_tour::bytes(tree_size)];
+      allocated_bytes += euler_tour::bytes(tree_size);
     }else{
-      tour = tree_pool.back();
+      tour = trees.back();
       tour.size = 0;
-      tree_pool.pop_back();
+      trees.pop_back();
     }
   }
 
   return tour;
 }
 
-void increase_tree_size() {
-  lock_guard<mutex> lock(bs_mutex);
+void tree_pool_t::increase_size() {
+  lock_guard<mutex> lock(m);
   tree_size *= 2;
-  for(auto t : tree_pool) delete[] t.data;
-  tree_pool.clear();
+  for(auto t : trees) delete[] t.data;
+  allocated_bytes -= trees.size() * euler_tour::bytes(tree_size / 2);
+  trees.clear();
 }
 
-void free_tree(euler_tour tree) {
-  lock_guard<mutex> lock(bs_mutex);
-  if(tree.size == tree_size) {
-    tree_pool.pb(tree);
+void tree_pool_t::free(euler_tour tree) {
+  lock_guard<mutex> lock(m);
+  if(tree.max_size == tree_size) {
+    trees.pb(tree);
   }else{
     delete[] tree.data;
+    allocated_bytes -= euler_tour::bytes(tree.max_size);
   }
 }
 
+euler_tour get_new_tree() {
+  return tree_pool->get();
+}
 
-void find_solution
-(vector<u8> &solution,
- u32 istep,
- beam_state S,
- euler_tour const& tour_current
- )
-{
-  vector<u8> stack_moves(istep);
-  u32 nstack_moves = 0;
-
-  FOR(iedge, tour_current.size) {
-    u8 edge = tour_current[iedge];
-    if(edge > 0) {
-      stack_moves[nstack_moves] = edge-1;
-      S.do_move(edge-1);
-      nstack_moves += 1;
-    }else{
-      if(nstack_moves == istep) {
-        if(S.is_solved()) {
-          solution = stack_moves;
-          return;
-        }
-      }
-        
-      if(nstack_moves == 0) {
-        break;
-      }
-				
-      nstack_moves -= 1;
-      S.undo_move(stack_moves[nstack_moves]);
-    }
-  }
+void free_tree(euler_tour tree) {
+  tree_pool->free(tree);
 }
 
+
 const u8 move_opposite[12] =
   {3,4,5,0,1,2,9,10,11,6,7,8};
 
+template<class STATE>
 void beam_search_instance::traverse_tour
 (beam_search_config const& config,
- beam_state S,
+ STATE S,
+ euler_tour const& tour_current,
+ vector<euler_tour> &tours_next)
+{
+  if(config.deterministic) {
+    traverse_tour_impl<true, STATE>(config, S, tour_current, tours_next);
+  }else{
+    traverse_tour_impl<false, STATE>(config, S, tour_current, tours_next);
+  }
+}
+
+void beam_search_instance::commit_hashes() {
+  for(auto [islot, key] : new_hashes) {
+    atomic_ref<u64> slot(hash_table[islot]);
+    u64 prev = slot.load(memory_order_relaxed);
+    while(prev < key && !slot.compare_exchange_weak(prev, key, memory_order_relaxed)) { }
+    // the entries of this level that are replaced or not inserted, which
+    // may be copies of the state that ends up in the slot
+    if(prev > key) lost_hashes.eb(islot, key);
+    else if(prev < key && (prev >> DETERMINISTIC_LEVEL_SHIFT) == level) lost_hashes.eb(islot, prev);
+  }
+  new_hashes.clear();
+}
+
+void beam_search_instance::check_lost_hashes() {
+  // only the final entry of the slot decides, whatever the commit order was
+  erase_if(lost_hashes, [&](auto const& p) {
+    auto [islot, key] = p;
+    u64 entry = hash_table[islot];
+    return entry == key || ((entry ^ key) & ~DETERMINISTIC_OWNER_MASK) != 0;
+  });
+}
+
+template<bool DETERMINISTIC, class STATE>
+void beam_search_instance::traverse_tour_impl
+(beam_search_config const& config,
+ STATE S,
  euler_tour const& tour_current,
  vector<euler_tour> &tours_next)
 {
   u32 nstack_moves = 0;
-  stack_last_move_src[0] = 12;
-  stack_last_move_tgt[0] = 12;
+  u64 parent_hash = 0; // of the leaves, in deterministic mode
+  stack_last_move_src[0] = root_last_move_src;
+  stack_last_move_tgt[0] = root_last_move_tgt;
 
   u32 ncommit = 0;
   if(tours_next.empty()) tours_next.eb(get_new_tree());
   auto *tour_next = &tours_next.back(); 
-  runtime_assert(tour_next->max_size == tree_size);
 
-  f32 cutoff_heur_running = 1.0 + rng.randomDouble();
-
-  f32 feature_save_running = rng.randomDouble();
+  f32 cutoff_heur_running = 1.0;
+  if constexpr(DETERMINISTIC) {
+    cutoff_heur_running += (uint64_hash::hash_int(tour_seed) >> 40) * 0x1p-24;
+  }else{
+    cutoff_heur_running += rng.randomDouble();
+  }
 
   FOR(iedge, tour_current.size) {
     u8 edge = tour_current[iedge];
     if(edge > 0) {
+      if(__builtin_expect(nstack_moves < trunk_size, false)) {
+        if(nstack_moves == trunk_filled) {
+          trunk[trunk_filled++] = edge-1;
+        }else if(trunk[nstack_moves] != edge-1) {
+          trunk_size = nstack_moves;
+        }
+      }
       stack_moves[nstack_moves] = edge-1;
+      if constexpr(DETERMINISTIC) {
+        if(nstack_moves+1 == istep) parent_hash = S.hash;
+      }
       S.do_move(edge-1);
       if(edge-1 < 6) {
         stack_last_move_src[nstack_moves+1] = move_opposite[edge-1];
@@ -120,17 +143,39 @@ void beam_search_instance::traverse_tour
     }else{
       if(nstack_moves == istep) {
 
+        auto v = S.value();
+
         if(config.features_save_probability > 0.0) {
-          feature_save_running += config.features_save_probability;
-          if(feature_save_running > 1.0) {
-            feature_save_running -= 1.0;
-            saved_features->eb();
-            get<0>(saved_features->back()) = istep;
-            S.features(get<1>(saved_features->back()));
+          u64 key = S.hash ^ features_save_key;
+          if(!config.features_save_hard) {
+            if(uint64_hash::hash_int(key) < features_save_threshold) {
+              saved_features.eb();
+              get<0>(saved_features.back()) = key;
+              S.features(get<1>(saved_features.back()));
+            }
+          }else{
+            // weighted reservoir sampling (Efraimidis-Spirakis), keeping the
+            // lowest -log(u)/weight. The weight decays with the distance to
+            // the cutoff, on both sides.
+            f64 u = ((uint64_hash::hash_int(key) >> 11) + 0.5) * 0x1p-53;
+            f64 priority = -log(u);
+            priority *= exp(abs((f64) v - (f64) cutoff_heur) / features_save_scale);
+            u64 priority_key = bit_cast<u64>(priority);
+
+            auto cmp = [](auto const& a, auto const& b) { return get<0>(a) < get<0>(b); };
+            if(saved_features.size() < features_save_capacity) {
+              saved_features.eb();
+              get<0>(saved_features.back()) = priority_key;
+              S.features(get<1>(saved_features.back()));
+              push_heap(all(saved_features), cmp);
+            }else if(priority_key < get<0>(saved_features.front())) {
+              pop_heap(all(saved_features), cmp);
+              get<0>(saved_features.back()) = priority_key;
+              S.features(get<1>(saved_features.back()));
+              push_heap(all(saved_features), cmp);
+            }
           }
         }
-        
-        auto v = S.value();
         bool keep = v < cutoff_heur;
         if(v == cutoff_heur) {
           cutoff_heur_running += cutoff_heur_keep_probability;
@@ -139,19 +184,62 @@ void beam_search_instance::traverse_tour
             cutoff_heur_running -= 1.0;
           }
         }
+        if constexpr(DETERMINISTIC) {
+          if(keep && istep > 0 && merged_away(S.hash, parent_hash)) keep = false;
+        }
         if(keep) {
           while(ncommit < nstack_moves) {
             tour_next->push(1+stack_moves[ncommit]);
             ncommit += 1;
           }
           
+          // plan all children first and prefetch their hash table slots, so
+          // that the probes below overlap their cache misses
+          u32 nchildren = 0;
+          u32 child_v[12];
+          u64 child_h[12];
+          bool child_solved[12];
+          u8 child_m[12];
           UNROLL_FOR12(m) if(m != stack_last_move_src[nstack_moves] &&
                              m != stack_last_move_tgt[nstack_moves]) {
             auto [v,h,solved] = S.plan_move(m);
-            auto prev = hash_table[h&HASH_MASK];
-            if(prev != h) {
-              hash_table[h&HASH_MASK] = h;
-              if(solved) found_solution = true;
+            __builtin_prefetch(&hash_table[h&hash_mask], 1);
+            child_v[nchildren] = v;
+            child_h[nchildren] = h;
+            child_solved[nchildren] = solved;
+            child_m[nchildren] = m;
+            nchildren += 1;
+          }
+          num_nodes += nchildren;
+
+          FOR(ichild, nchildren) {
+            u32 v = child_v[ichild];
+            u64 h = child_h[ichild];
+            bool solved = child_solved[ichild];
+            u8 m = child_m[ichild];
+            auto prev = hash_table[h&hash_mask];
+            bool is_new;
+            if constexpr(DETERMINISTIC) {
+              u64 key = deterministic_key(level, h, S.hash);
+              auto &local = local_hash_table[h & (local_hash_table.size()-1)];
+              is_new = ((prev ^ h) & DETERMINISTIC_HASH_MASK & ~DETERMINISTIC_OWNER_MASK) != 0 &&
+                ((local ^ key) & ~DETERMINISTIC_OWNER_MASK) != 0;
+              if(is_new) {
+                local = key;
+                new_hashes.eb(h & hash_mask, key);
+              }
+            }else{
+              is_new = prev != h;
+              if(is_new) hash_table[h&hash_mask] = h;
+            }
+            if(is_new) {
+              if(solved) {
+                if(solutions.size() < max_solutions) {
+                  solutions.eb(stack_moves, stack_moves + nstack_moves);
+                  solutions.back().pb(m);
+                }
+                found_solution = true;
+              }
               low_heur = min(low_heur, v);
               high_heur = max(high_heur, v);
               histogram_heur[v] += 1;
@@ -175,7 +263,7 @@ void beam_search_instance::traverse_tour
       S.undo_move(stack_moves[nstack_moves]);
     }
     
-    if(__builtin_expect(tour_next->size + 2 * istep + 128 > tree_size, false)) {
+    if(__builtin_expect(tour_next->size + 2 * istep + 128 > tour_next->max_size, false)) {
       FORD(i,ncommit-1,0) tour_next->push(0);
       tour_next->push(0);
       tours_next.eb(get_new_tree());
@@ -185,9 +273,244 @@ void beam_search_instance::traverse_tour
   }
 }
 
+// Removes the first k levels of a tour whose paths all go through them.
+// Siblings below the k-th level, which a tour can hold under several copies
+// of the trunk, are merged.
+void strip_trunk(euler_tour &tour, u32 k) {
+  runtime_assert(k > 0);
+  // Writing never overtakes reading, as the first k edges are dropped.
+  i64 size = tour.size;
+  tour.size = 0;
+  u32 depth = 0;
+  FOR(iedge, size) {
+    u8 edge = tour[iedge];
+    if(edge > 0) {
+      if(depth >= k) tour.push(edge);
+      depth += 1;
+    }else{
+      if(depth > k) tour.push(0);
+      if(depth == 0) break;
+      depth -= 1;
+    }
+  }
+}
+
+f64 width_schedule_fraction(vector<pair<f32, f32>> const& schedule, f64 progress) {
+  if(schedule.empty()) return 1.0;
+  if(progress <= schedule.front().first) return schedule.front().second;
+  FOR(i, schedule.size()-1) {
+    auto [p0, f0] = schedule[i];
+    auto [p1, f1] = schedule[i+1];
+    if(progress <= p1) {
+      return f0 + (f1 - f0) * (progress - p0) / max<f64>(1e-9, p1 - p0);
+    }
+  }
+  return schedule.back().second;
+}
+
+u32 hash_bits_for_width(u64 width) {
+  u32 hash_bits = MIN_HASH_BITS;
+  while(hash_bits < MAX_HASH_BITS && (1ull<<hash_bits) < 64 * width) hash_bits += 1;
+  return hash_bits;
+}
+
+u32 local_hash_bits(beam_search_config const& config) {
+  // the children a thread inserts during a level, a few per kept state
+  u64 children = 8 * config.width / max(1u, config.num_threads);
+  u32 hash_bits = MIN_HASH_BITS;
+  while(hash_bits < config.hash_bits && (1ull<<hash_bits) < children) hash_bits += 1;
+  return hash_bits;
+}
+
+// bench.cpp times the traversal on its own
+template void beam_search_instance::traverse_tour<beam_state>
+(beam_search_config const&, beam_state, euler_tour const&, vector<euler_tour>&);
+
+u32 beam_search_max_heur(beam_state const& initial_state) {
+  return initial_state.value() * 1.2 + 1024;
+}
+
+// everything but the tours
+u64 beam_search_fixed_memory(beam_search_config const& config, u32 max_heur) {
+  u64 hash_memory = sizeof(u64) << config.hash_bits;
+  u64 instances_memory = config.num_threads *
+    (sizeof(beam_search_instance) + sizeof(beam_state));
+  u64 histograms_memory = (config.num_threads + 1) * sizeof(u32) * max_heur;
+  u64 deterministic_memory = config.deterministic ?
+    config.num_threads * (sizeof(u64) << local_hash_bits(config)) : 0;
+  return hash_memory + instances_memory + histograms_memory + deterministic_memory;
+}
+
+u64 beam_search_memory(beam_search_config const& config, u32 max_heur) {
+  // the children of the current level, and the children of the next one,
+  // plus a partly filled tree per thread
+  u64 edges = config.width * TOUR_EDGES_PER_STATE;
+  i64 tree_size = MIN_TREE_SIZE;
+  while(edges / tree_size >= 128) tree_size *= 2;
+  u64 tours_memory = 2 * euler_tour::bytes(edges) +
+    2 * (config.num_threads + 1) * euler_tour::bytes(tree_size);
+  return beam_search_fixed_memory(config, max_heur) + tours_memory;
+}
+
+beam_search_config plan_beam_search
+(beam_search_config config,
+ u64 mem_budget,
+ u32 max_heur)
+{
+  auto fits = [&](u64 width) {
+    auto c = config;
+    c.width = width;
+    c.hash_bits = hash_bits_for_width(width);
+    return beam_search_memory(c, max_heur) <= mem_budget;
+  };
+  u64 max_width = config.width > 0 ? config.width : 1ull<<40;
+  if(!fits(1)) throw runtime_error("memory budget too small for a beam search");
+  u64 lo = 1, hi = 2;
+  while(hi <= max_width && fits(hi)) { lo = hi; hi *= 2; }
+  hi = min(hi, max_width+1);
+  while(lo+1 < hi) {
+    u64 mid = (lo+hi) / 2;
+    if(fits(mid)) lo = mid; else hi = mid;
+  }
+  config.width = lo;
+  config.hash_bits = hash_bits_for_width(lo);
+  config.mem_budget = mem_budget;
+  return config;
+}
+
+beam_search_cutoff select_cutoff
+(u32* histogram_heur,
+ u32 low_heur,
+ u32 high_heur,
+ u64 width,
+ u32 max_heur)
+{
+  beam_search_cutoff cutoff {
+    .cutoff_heur = max_heur,
+    .keep_probability = 1.0,
+    .average_heur = 0,
+    .num_children = 0,
+  };
+
+  u64 total_count = 0;
+  FORU(i, low_heur, high_heur) {
+    if(total_count + histogram_heur[i] > width) {
+      cutoff.average_heur += (f64) i * (width-total_count);
+      cutoff.cutoff_heur = i;
+      cutoff.keep_probability = (f32)(width-total_count) / (f32)(histogram_heur[i]);
+      total_count = width;
+      break;
+    }
+    total_count += histogram_heur[i];
+    cutoff.average_heur += (f64) i * histogram_heur[i];
+  }
+  FORU(i, low_heur, high_heur) {
+    cutoff.num_children += histogram_heur[i];
+    histogram_heur[i] = 0;
+  }
+  cutoff.average_heur /= max<f64>(1, total_count);
+
+  return cutoff;
+}
+
+// Orders the cpus so that consecutive threads land on different packages,
+// then on different cores of a package, and only then on the hyperthread
+// siblings of cores already used. Without the sysfs topology, every cpu is
+// its own core.
+static vector<i32> spread_cpus(vector<i32> const& cpus) {
+  auto read_id = [](i32 cpu, string const& name, i32 fallback) {
+    ifstream is("/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology/" + name);
+    i32 id;
+    if(!(is >> id)) return fallback;
+    return id;
+  };
+
+  // (package, sibling rank within its core, core, cpu)
+  vector<tuple<i32, i32, i32, i32>> topology;
+  map<pair<i32, i32>, i32> core_count;
+  for(auto cpu : cpus) {
+    i32 package = read_id(cpu, "physical_package_id", 0);
+    i32 core = read_id(cpu, "core_id", cpu);
+    i32 rank = core_count[mp(package, core)]++;
+    topology.eb(package, rank, core, cpu);
+  }
+  sort(all(topology));
+
+  // round robin over the packages, each in its order
+  map<i32, vector<i32>> by_package;
+  for(auto const& [package, rank, core, cpu] : topology) by_package[package].pb(cpu);
+  vector<i32> order;
+  for(u32 i = 0; order.size() < cpus.size(); ++i) {
+    for(auto const& [package, package_cpus] : by_package) {
+      if(i < package_cpus.size()) order.pb(package_cpus[i]);
+    }
+  }
+  return order;
+}
+
+// The cpus pinned by the running parallel regions, so that concurrent
+// searches, as in a portfolio or a batch, pin to different cpus.
+static mutex pinned_mutex;
+static vector<bool> pinned_cpus(CPU_SETSIZE, false);
+
+// Takes cpus from spread for the threads of one parallel region. The threads
+// are not pinned when other searches left too few cpus free.
+struct cpu_claim {
+  vector<i32> cpus;
+
+  cpu_claim(vector<i32> const& spread, u32 num_threads) {
+    if(spread.empty()) return;
+    lock_guard lock(pinned_mutex);
+    for(auto cpu : spread) {
+      if(cpus.size() == num_threads) break;
+      if(!pinned_cpus[cpu]) cpus.pb(cpu);
+    }
+    if(cpus.size() < min<u64>(num_threads, spread.size())) {
+      cpus.clear();
+      return;
+    }
+    for(auto cpu : cpus) pinned_cpus[cpu] = true;
+  }
+
+  ~cpu_claim() {
+    lock_guard lock(pinned_mutex);
+    for(auto cpu : cpus) pinned_cpus[cpu] = false;
+  }
+};
+
+// Pins the calling thread to its cpu of the claim, and restores its previous
+// affinity at the end of the region.
+struct thread_pin_guard {
+  bool pinned = false;
+  cpu_set_t saved;
+
+  thread_pin_guard(cpu_claim const& claim, u32 thread_id) {
+    if(claim.cpus.empty()) return;
+    if(pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) != 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(claim.cpus[thread_id % claim.cpus.size()], &set);
+    pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+  }
+
+  ~thread_pin_guard() {
+    if(pinned) pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+  }
+};
+
 beam_search::beam_search(beam_search_config config_) {
   config = config_;
-  hash_table.assign(HASH_SIZE, rng.randomInt64());
+  tables = solver_tables::current();
+  runtime_assert(MIN_HASH_BITS <= config.hash_bits && config.hash_bits <= MAX_HASH_BITS);
+  hash_size = 1ull<<config.hash_bits;
+  hash_table = make_unique_for_overwrite<u64[]>(hash_size);
+  if(config.pin_threads) {
+    cpu_set_t allowed;
+    runtime_assert(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+    FOR(cpu, CPU_SETSIZE) if(CPU_ISSET(cpu, &allowed)) cpus.pb(cpu);
+    cpus = spread_cpus(cpus);
+  }
+  fill_hash_table(rng.randomInt64());
   should_stop = false;
 
   L_histograms_heur.resize(config.num_threads);
@@ -197,83 +520,241 @@ beam_search::beam_search(beam_search_config config_) {
 beam_search::~beam_search() {
 }
 
+void beam_search::fill_hash_table(u64 value) {
+  cpu_claim claim(cpus, config.num_threads);
+#pragma omp parallel num_threads(config.num_threads)
+  {
+    u32 thread_id = omp_get_thread_num();
+    u32 num_threads = omp_get_num_threads();
+    thread_pin_guard pin(claim, thread_id);
+    // the same static split as a parallel for, in whole pages
+    u64 chunk = (hash_size / num_threads + 511) & ~511ull;
+    u64 begin = min(hash_size, thread_id * chunk);
+    u64 end = min(hash_size, begin + chunk);
+    fill(hash_table.get() + begin, hash_table.get() + end, value);
+  }
+}
+
 beam_search_result
 beam_search::search(beam_state const& initial_state) {
-  u32 max_heur = initial_state.value() * 1.2 + 1024;
+  solver_tables_guard guard(tables);
+  u32 max_heur = beam_search_max_heur(initial_state);
+  // only the searches that sample features pay for their incremental counts
+  if(config.features_save_probability > 0.0) {
+    tracked_beam_state root;
+    root.assign(initial_state);
+    return search_impl(root, max_heur);
+  }
+  return search_impl(initial_state, max_heur);
+}
+
+template<class STATE>
+beam_search_result
+beam_search::search_impl(STATE root, u32 max_heur) {
+  timer timer_search;
   if(histogram_heur.size() < max_heur) histogram_heur.resize(max_heur);
 
+  if(config.deterministic) {
+    // hashes are only compared relative to the root, so the random base can be replaced,
+    // and the tables must not keep entries from earlier searches
+    root.hash = uint64_hash::hash_int(config.seed);
+    fill_hash_table(0);
+    for(auto &L_instance : L_instances) fill(all(L_instance.local_hash_table), 0);
+    merged_away_keys.clear();
+  }
+  u64 features_save_threshold = 0;
   if(config.features_save_probability > 0.0) {
-    runtime_assert(config.num_threads == 1);
+    features_save_threshold =
+      config.features_save_probability >= 1.0 ? numeric_limits<u64>::max()
+      : (u64) ldexp((f64) config.features_save_probability, 64);
   }
   
+  // The tours start at root, which is moved down their common trunk.
+  STATE const initial_root = root;
+  vector<u8> trunk;
+  u8 root_last_move_src = 12, root_last_move_tgt = 12;
+
   vector<euler_tour> tours_current;
   tours_current.eb(get_new_tree());
   tours_current.back().push(0);
 
   u32 cutoff_heur = max_heur;
   f32 cutoff_heur_keep_probability = 1.0;
+  u64 width = config.width; // at most, to fit in mem_budget
+  u64 level_width = config.width; // of the last level
+  u32 initial_heur = max(1, root.value());
+  u32 last_low_heur = max_heur;
+  u64 features_save_capacity = 1;
+
+  u64 level_states = 1; // kept for the current level
+  bool level_full = false; // level_states is the width, not all the children
+  f64 seconds_per_state = 0; // smoothed over the levels
+  u64 time_width = config.width;
   
   vector<tuple<i32, features_vec > > saved_features;
+  // features of the states along the trunk, at the levels of saved_features
+  vector<tuple<i32, features_vec > > path_features;
+  u32 ipath = 0; // first entry of saved_features not in path_features
+  auto add_path_features = [&](STATE const& S, u32 depth) {
+    while(ipath < saved_features.size() && (u32)get<0>(saved_features[ipath]) < depth) {
+      ipath += 1;
+    }
+    if(ipath == saved_features.size() || (u32)get<0>(saved_features[ipath]) != depth) return;
+    path_features.eb();
+    get<0>(path_features.back()) = depth;
+    S.features(get<1>(path_features.back()));
+    while(ipath < saved_features.size() && (u32)get<0>(saved_features[ipath]) == depth) {
+      ipath += 1;
+    }
+  };
   u32 best_low = max_heur;
   u32 last_improvement = 0;
+  u64 num_nodes = 0;
 
   vector<beam_search_result_entry> graph;
+
+  // from the initial state, sorted by length then moves
+  vector<vector<u8>> solutions;
+  u32 max_solutions = max(1u, config.num_solutions);
+  i64 first_solution_step = -1;
+
+  auto solved_result = [&]() {
+    for(auto tour : tours_current) free_tree(tour);
+
+    auto const& solution = solutions[0];
+    if(config.features_save_probability > 0.0) {
+      // Only the part of the solution below the trunk is replayed, unless an
+      // earlier solution left the trunk.
+      STATE T = root;
+      u32 curi = trunk.size();
+      if(!equal(all(trunk), begin(solution))) {
+        T = initial_root;
+        curi = 0;
+        path_features.clear();
+        ipath = 0;
+      }
+      add_path_features(T, curi);
+      while(curi < solution.size() && ipath < saved_features.size()) {
+        T.do_move(solution[curi]);
+        curi += 1;
+        add_path_features(T, curi);
+      }
+    }
+
+    return beam_search_result {
+      .solution = solution,
+      .solutions = solutions,
+      .saved_features = saved_features,
+      .path_features = path_features,
+      .graph = graph,
+      .num_nodes = num_nodes,
+    };
+  };
+
+  // without a solution, after max_steps or a failure
+  auto unsolved_result = [&]() {
+    for(auto tour : tours_current) free_tree(tour);
+    return beam_search_result {
+      .solution = {},
+      .solutions = {},
+      .saved_features = saved_features,
+      .path_features = {},
+      .graph = graph,
+      .num_nodes = num_nodes,
+      .stopped = should_stop,
+    };
+  };
   
   for(u32 istep = 0;; ++istep) {
+    if(config.max_solution_length &&
+       istep + 1 >= config.max_solution_length->load(memory_order_relaxed)) {
+      should_stop = true;
+    }
+
+    if(!solutions.empty() &&
+       (solutions.size() >= max_solutions ||
+        istep > first_solution_step + config.solutions_extra_levels ||
+        (config.max_steps > 0 && istep >= config.max_steps) ||
+        should_stop || istep > MAX_SOLUTION_SIZE - 10 ||
+        istep > last_improvement + 100)) {
+      return solved_result();
+    }
+
+    if(config.max_steps > 0 && istep >= config.max_steps) {
+      return unsolved_result();
+    }
+
     if(should_stop || istep > MAX_SOLUTION_SIZE - 10 ||
        istep > last_improvement + 100) {
-      debug("FAIL");
-      return beam_search_result{};
+      // stopped searches are expected in a portfolio, only failures are told
+      if(!should_stop) debug("FAIL");
+      return unsolved_result();
     }
     
     timer timer_s;
 
     u32 low_heur = max_heur, high_heur = 0;
     bool found_solution = false;
+    vector<u8> level_trunk;
     
     {
-      if(tours_current.size() >= 128) increase_tree_size();
+      if(tours_current.size() >= 128) tree_pool->increase_size();
       
-      sort(all(tours_current), [&](auto const& t1, auto const& t2) {
+      stable_sort(all(tours_current), [&](auto const& t1, auto const& t2) {
         return t1.size < t2.size;
       });
       
       vector<euler_tour> tours_next;
+      vector<vector<euler_tour>> tours_next_by_thread(config.num_threads);
+      bool level_trunk_seen = false;
 
+      // cpus is in spread order, so the first threads take one core per package
+      cpu_claim claim(cpus, config.num_threads);
 #pragma omp parallel num_threads(config.num_threads)
       {
+        tables.bind();
         u32 thread_id = omp_get_thread_num();
+        u32 num_threads = omp_get_num_threads();
+        thread_pin_guard pin(claim, thread_id);
 
         auto &L_histogram_heur = L_histograms_heur[thread_id];
         if(L_histogram_heur.size() < max_heur) L_histogram_heur.resize(max_heur, 0);
         auto &L_instance = L_instances[thread_id];
 
+        L_instance.hash_table = hash_table.get();
+        L_instance.hash_mask = hash_size - 1;
+        L_instance.merged_away_keys = &merged_away_keys;
+        L_instance.histogram_heur = L_histogram_heur.data();
+        L_instance.istep = istep - trunk.size();
+        L_instance.level = istep;
+        L_instance.root_last_move_src = root_last_move_src;
+        L_instance.root_last_move_tgt = root_last_move_tgt;
+        L_instance.trunk_size = L_instance.istep;
+        L_instance.trunk_filled = 0;
+        L_instance.max_solutions = max_solutions;
+        L_instance.solutions.clear();
+        L_instance.cutoff_heur = cutoff_heur;
+        L_instance.cutoff_heur_keep_probability = cutoff_heur_keep_probability;
+        L_instance.features_save_key =
+          initial_root.hash ^ uint64_hash::hash_int(config.seed * MAX_SOLUTION_SIZE + istep);
+        L_instance.features_save_threshold = features_save_threshold;
+        L_instance.features_save_capacity = features_save_capacity;
+        L_instance.features_save_scale = max(1.0, (cutoff_heur - last_low_heur) / 4.0);
+        if(config.deterministic &&
+           L_instance.local_hash_table.size() != (1ull<<local_hash_bits(config))) {
+          L_instance.local_hash_table.assign(1ull<<local_hash_bits(config), 0);
+        }
+
         vector<euler_tour> L_tours_next;
 
-        while(1) {
-          euler_tour tour_current;
-#pragma omp critical
-          { if(!tours_current.empty()) {
-              tour_current = tours_current.back();
-              tours_current.pop_back();
-            }else{
-              tour_current.size = 0;
-            }
-          }
-          if(tour_current.size == 0) break;
-          
-          L_instance.hash_table = hash_table.data();
-          L_instance.histogram_heur = L_histogram_heur.data();
-          L_instance.istep = istep;
-          L_instance.cutoff_heur = cutoff_heur;
-          L_instance.cutoff_heur_keep_probability = cutoff_heur_keep_probability;
+        auto traverse = [&](euler_tour tour_current) {
           L_instance.low_heur = max_heur;
           L_instance.high_heur = 0;
           L_instance.found_solution = false;
-          L_instance.saved_features = &saved_features;
+          L_instance.num_nodes = 0;
         
           L_instance.traverse_tour
-            (config, initial_state, tour_current, L_tours_next);
+            (config, root, tour_current, L_tours_next);
 
 #pragma omp critical
           {
@@ -281,6 +762,36 @@ beam_search::search(beam_state const& initial_state) {
             low_heur = min(low_heur, L_instance.low_heur);
             high_heur = max(high_heur, L_instance.high_heur);
             found_solution = found_solution || L_instance.found_solution;
+            num_nodes += L_instance.num_nodes;
+          }
+        };
+
+        if(config.deterministic) {
+          // fixed assignment of the tours to threads, largest first
+          for(i64 itour = (i64) tours_current.size() - 1 - thread_id;
+              itour >= 0; itour -= num_threads) {
+            L_instance.tour_seed =
+              uint64_hash::hash_int((config.seed * MAX_SOLUTION_SIZE + istep) * 4096 + itour);
+            traverse(tours_current[itour]);
+          }
+#pragma omp barrier
+          L_instance.commit_hashes();
+#pragma omp barrier
+          L_instance.check_lost_hashes();
+          tours_next_by_thread[thread_id] = L_tours_next;
+        }else{
+          while(1) {
+            euler_tour tour_current;
+#pragma omp critical
+            { if(!tours_current.empty()) {
+                tour_current = tours_current.back();
+                tours_current.pop_back();
+              }else{
+                tour_current.size = 0;
+              }
+            }
+            if(tour_current.size == 0) break;
+            traverse(tour_current);
           }
         }
 
@@ -290,30 +801,155 @@ beam_search::search(beam_state const& initial_state) {
             histogram_heur[i] += L_histogram_heur[i];
             L_histogram_heur[i] = 0;
           }
+          if(!config.deterministic) {
+            tours_next.insert(end(tours_next), all(L_tours_next));
+          }
+          // the first solutions of each thread only depend on its tours
+          for(auto const& solution : L_instance.solutions) {
+            solutions.eb(trunk);
+            solutions.back().insert(end(solutions.back()), all(solution));
+          }
+          if(L_instance.trunk_filled > 0) {
+            u32 size = min(L_instance.trunk_size, L_instance.trunk_filled);
+            if(!level_trunk_seen) {
+              level_trunk.assign(L_instance.trunk, L_instance.trunk + size);
+              level_trunk_seen = true;
+            }else{
+              u32 common = 0;
+              while(common < min<u32>(size, level_trunk.size()) &&
+                    level_trunk[common] == L_instance.trunk[common]) {
+                common += 1;
+              }
+              level_trunk.resize(common);
+            }
+          }
+        }
+      }
+
+      if(config.deterministic) {
+        for(auto const& L_tours_next : tours_next_by_thread) {
           tours_next.insert(end(tours_next), all(L_tours_next));
         }
+        merged_away_keys.clear();
+        for(auto &L_instance : L_instances) {
+          for(auto [islot, key] : L_instance.lost_hashes) merged_away_keys.pb(key);
+          L_instance.lost_hashes.clear();
+        }
+        sort(all(merged_away_keys));
       }
       
       tours_current = tours_next;
+
+    }
+
+    if(config.features_save_probability > 0.0) {
+      // merge the per-thread samples, in an order independent of scheduling
+      vector<tuple<u64, features_vec > > level_features;
+      for(auto &L_instance : L_instances) {
+        level_features.insert(end(level_features), all(L_instance.saved_features));
+        L_instance.saved_features.clear();
+      }
+      sort(all(level_features), [&](auto const& a, auto const& b) {
+        return get<0>(a) < get<0>(b);
+      });
+      if(config.features_save_hard && level_features.size() > features_save_capacity) {
+        level_features.resize(features_save_capacity);
+      }
+      for(auto const& [h, v] : level_features) {
+        saved_features.eb(istep, v);
+      }
+    }
+
+    // Every child goes through the trunk of its parents. Move the root
+    // down, so that it is not replayed and stored by each tour anymore.
+    if(level_trunk.size() >= REBASE_MIN_TRUNK) {
+      u32 k = level_trunk.size();
+#pragma omp parallel for num_threads(config.num_threads) schedule(dynamic, 1)
+      FOR(itour, tours_current.size()) strip_trunk(tours_current[itour], k);
+      add_path_features(root, trunk.size());
+      for(auto m : level_trunk) {
+        root.do_move(m);
+        trunk.pb(m);
+        add_path_features(root, trunk.size());
+        if(m < 6) root_last_move_src = move_opposite[m];
+        else root_last_move_tgt = move_opposite[m];
+      }
     }
     
-    f64 average_heur = 0;
-    { u64 total_count = 0;
-      cutoff_heur = max_heur;
-      cutoff_heur_keep_probability = 1.0;
-      FORU(i, low_heur, high_heur) {
-        if(total_count + histogram_heur[i] > config.width) {
-          average_heur += (f64) i * (config.width-total_count);
-          cutoff_heur = i;
-          cutoff_heur_keep_probability = (f32)(config.width-total_count) / (f32)(histogram_heur[i]);
-          total_count = config.width;
-          break;
+    if(config.mem_budget > 0) {
+      // The next level holds these tours while building its own, whose size
+      // is proportional to the width, plus a partly filled tree per thread.
+      // Shrink the width when they would not fit, and let it grow back to
+      // config.width when they fit again.
+      u64 tours_memory = 0, tours_edges = 0;
+      for(auto const& tour : tours_current) {
+        tours_memory += euler_tour::bytes(tour.max_size);
+        tours_edges += tour.size;
+      }
+      i64 slack = (config.num_threads + 1) * euler_tour::bytes(tree_pool->tree_size);
+      i64 available = (i64) config.mem_budget - beam_search_fixed_memory(config, max_heur)
+        - tours_memory - slack;
+      u64 new_width = clamp<u64>
+        ((f64) level_width * max<i64>(0, available) / max<u64>(1, euler_tour::bytes(tours_edges)),
+         1, config.width);
+      if(new_width < width || (new_width > width * 1.1)) {
+        if(config.print && (new_width < width * 0.99 || new_width > width)) {
+#pragma omp critical
+          cerr << "memory: tours = " << tours_memory / (1<<20) << "MB"
+               << ", width " << width << " -> " << new_width << endl;
+        }
+        width = new_width;
+      }
+    }
+
+    { f64 progress = clamp(1.0 - (f64) low_heur / initial_heur, 0.0, 1.0);
+      u64 scheduled_width = max<u64>
+        (1, config.width * width_schedule_fraction(config.width_schedule, progress));
+      level_width = min(width, scheduled_width);
+    }
+
+    if(config.time_budget > 0 && level_full) {
+      // The time of a full level is proportional to its states. The levels
+      // left are extrapolated from the decrease of the best cost, as it
+      // reaches 0 at the solution. The decrease slows down with the cost,
+      // about as cost^p, with p fitted on the last two windows of levels.
+      f64 level_seconds = timer_s.elapsed() / max<u64>(1, level_states);
+      seconds_per_state = seconds_per_state == 0 ? level_seconds
+        : 0.8 * seconds_per_state + 0.2 * level_seconds;
+      u32 window = min<u32>(istep, 64);
+      f64 decrease = window > 0 ? (f64) graph[istep - window].min_cost - low_heur : 0;
+      if(decrease > 0) {
+        f64 p = 0.5;
+        if(istep >= 2 * window) {
+          f64 cost0 = graph[istep - 2*window].min_cost, cost1 = graph[istep - window].min_cost;
+          f64 previous_decrease = cost0 - cost1;
+          if(previous_decrease > 0 && cost1 > low_heur) {
+            p = clamp(log(previous_decrease / decrease) / log((cost0 + cost1) / (cost1 + low_heur)),
+                      0.0, 0.8);
+          }
         }
-        total_count += histogram_heur[i];
-        average_heur += (f64) i * histogram_heur[i];
+        // integral of dcost / (rate * (cost / low_heur)^p) from 0 to low_heur
+        f64 levels_left = low_heur * window / decrease / (1 - p);
+        f64 seconds_left = config.time_budget - timer_search.elapsed();
+        f64 target = seconds_left / max(1.0, levels_left) / seconds_per_state;
+        // move smoothly, but faster down than up
+        time_width = clamp<f64>(target, 0.5 * time_width, 1.25 * time_width);
+        time_width = clamp<u64>(time_width, 1, config.width);
       }
-      FORU(i, low_heur, high_heur) histogram_heur[i] = 0;
-      average_heur /= max<f64>(1, total_count);
+    }
+    level_width = min(level_width, time_width);
+
+    f64 average_heur;
+    { auto cutoff = select_cutoff
+        (histogram_heur.data(), low_heur, high_heur, level_width, max_heur);
+      cutoff_heur = cutoff.cutoff_heur;
+      cutoff_heur_keep_probability = cutoff.keep_probability;
+      average_heur = cutoff.average_heur;
+      level_states = min<u64>(level_width, cutoff.num_children);
+      level_full = cutoff.num_children >= level_width;
+      // as many hard samples as uniform sampling would take from the next level
+      features_save_capacity =
+        max<u64>(1, ceil(config.features_save_probability * cutoff.num_children));
     }
    
     i64 total_size = 0;
@@ -321,6 +957,8 @@ beam_search::search(beam_state const& initial_state) {
       total_size += tour.size;
     }
 
+    last_low_heur = low_heur;
+
     if(low_heur < best_low) {
       best_low = low_heur;
       last_improvement = istep;
@@ -330,6 +968,7 @@ beam_search::search(beam_state const& initial_state) {
         .step     = (i32)istep,
         .min_cost = low_heur,
         .avg_cost = (f32)average_heur,
+        .width    = level_width,
       });
 
     if(config.print && (istep % config.print_interval == 0)) {
@@ -346,23 +985,12 @@ beam_search::search(beam_state const& initial_state) {
     }
 
     if(found_solution) {
-      vector<u8> solution;
-      
-      for(auto tour_current : tours_current) {
-        find_solution(solution, istep+1, initial_state, tour_current);
-        if(!solution.empty()) break;
-      }
-
-      runtime_assert(!solution.empty());
-
-      beam_state T = initial_state;
-      for(auto move : solution) T.do_move(move);
-
-      return beam_search_result {
-        .solution = solution,
-        .saved_features = saved_features,
-        .graph = graph,
-      };
+      sort(all(solutions), [](auto const& a, auto const& b) {
+        return a.size() != b.size() ? a.size() < b.size() : a < b;
+      });
+      solutions.erase(unique(all(solutions)), end(solutions));
+      if(solutions.size() > max_solutions) solutions.resize(max_solutions);
+      if(first_solution_step < 0) first_solution_step = istep;
     }
   }
 }
@@ -18,10 +18,15 @@ u64 hash_pos(u32 x, u32 y) {
   return uint64_hash::hash_int(x * 4096 + y);
 }
 
-struct beam_state {
+// The state of a search, with the cost type of the evaluation: cost_t, or
+// tracked_cost_t to also maintain the feature counts.
+template<class cost_type>
+struct basic_beam_state {
+  static constexpr bool TRACK_FEATURES = is_same_v<cost_type, tracked_cost_t>;
+
   puzzle_state src, tgt;
 
-  cost_t cost;
+  cost_type cost;
   u64 hash;
   
   u32  num_unsolved;
@@ -32,22 +37,49 @@ struct beam_state {
     cost.reset();
     hash = rng.randomInt64();
 
-    num_unsolved = puzzle.size-1;
+    num_unsolved = puzzle->size-1;
     cost.rem_nei(bit(6)-1);
 
-    FOR(u, puzzle.size) {
+    FOR(u, puzzle->size) {
       cell_solved[u] = 0;
       cell_nei_solved[u] = 0;
     }
 
-    FOR(u, puzzle.size) if(src.pos_to_tok[u] != 0 &&
+    FOR(u, puzzle->size) if(src.pos_to_tok[u] != 0 &&
                            src.pos_to_tok[u] == tgt.pos_to_tok[u]) {
       add_solved(u);
     }
     
-    FORU(u, 1, puzzle.size-1) {
+    FORU(u, 1, puzzle->size-1) {
       add_dist(u);
     }
+
+    if constexpr(TRACK_FEATURES) enable_features();
+  }
+
+  // The same state, with another cost type.
+  template<class other_cost_type>
+  void assign(basic_beam_state<other_cost_type> const& other) {
+    src = other.src;
+    tgt = other.tgt;
+    cost.cost = other.cost.cost;
+    hash = other.hash;
+    num_unsolved = other.num_unsolved;
+    FOR(u, MAX_SIZE) {
+      cell_solved[u] = other.cell_solved[u];
+      cell_nei_solved[u] = other.cell_nei_solved[u];
+    }
+    if constexpr(TRACK_FEATURES) enable_features();
+  }
+
+  // Random instance, with random directions, for the given seed.
+  void generate(u64 seed) {
+    RNG seed_rng(seed);
+    src.generate(seed);
+    src.direction = seed_rng.random32(2);
+    tgt.set_tgt();
+    tgt.direction = seed_rng.random32(2);
+    init();
   }
 
   FORCE_INLINE
@@ -68,7 +100,7 @@ struct beam_state {
     cell_solved[u] = 1;
     cost.rem_nei(cell_nei_solved[u]);
     FOR(d, 6) {
-      auto v = puzzle.rot[u][d];
+      auto v = puzzle->rot[u][d];
       if(!cell_solved[v]) {
         cost.rem_nei(cell_nei_solved[v]);
         cell_nei_solved[v] ^= bit(d);
@@ -84,7 +116,7 @@ struct beam_state {
     num_unsolved += 1;
     cell_solved[u] = 0;
     FOR(d, 6) {
-      auto v = puzzle.rot[u][d];
+      auto v = puzzle->rot[u][d];
       if(!cell_solved[v]) {
         cost.rem_nei(cell_nei_solved[v]);
         cell_nei_solved[v] ^= bit(d);
@@ -102,19 +134,19 @@ struct beam_state {
   //   u64 h = hash;
     
   //   u32 a = src.tok_to_pos[0], b, c;
-  //   b = puzzle.rot[a][move];
-  //   c = puzzle.rot[a][(move+(src.direction?5:1))%6];
+  //   b = puzzle->rot[a][move];
+  //   c = puzzle->rot[a][(move+(src.direction?5:1))%6];
 
   //   u32 xb = src.pos_to_tok[b];
   //   u32 xc = src.pos_to_tok[c];
 
   //   h ^= hash_pos(b, tgt.tok_to_pos[xb]);
   //   h ^= hash_pos(c, tgt.tok_to_pos[xc]);
-  //   v -= weights.dist_weight[b][tgt.tok_to_pos[xb]];
-  //   v -= weights.dist_weight[c][tgt.tok_to_pos[xc]];
+  //   v -= weights->dist_weight[b][tgt.tok_to_pos[xb]];
+  //   v -= weights->dist_weight[c][tgt.tok_to_pos[xc]];
 
-  //   v += weights.dist_weight[c][tgt.tok_to_pos[xb]];
-  //   v += weights.dist_weight[a][tgt.tok_to_pos[xc]];
+  //   v += weights->dist_weight[c][tgt.tok_to_pos[xb]];
+  //   v += weights->dist_weight[a][tgt.tok_to_pos[xc]];
   //   h ^= hash_pos(c, tgt.tok_to_pos[xb]);
   //   h ^= hash_pos(a, tgt.tok_to_pos[xc]);
 
@@ -129,19 +161,19 @@ struct beam_state {
   //   u64 h = hash;
 
   //   u32 a = tgt.tok_to_pos[0], b, c;
-  //   b = puzzle.rot[a][move];
-  //   c = puzzle.rot[a][(move+(tgt.direction?5:1))%6];
+  //   b = puzzle->rot[a][move];
+  //   c = puzzle->rot[a][(move+(tgt.direction?5:1))%6];
 
   //   u32 xb = tgt.pos_to_tok[b];
   //   u32 xc = tgt.pos_to_tok[c];
 
   //   h ^= hash_pos(src.tok_to_pos[xb], b);
   //   h ^= hash_pos(src.tok_to_pos[xc], c);
-  //   v -= weights.dist_weight[src.tok_to_pos[xb]][b];
-  //   v -= weights.dist_weight[src.tok_to_pos[xc]][c];
+  //   v -= weights->dist_weight[src.tok_to_pos[xb]][b];
+  //   v -= weights->dist_weight[src.tok_to_pos[xc]][c];
     
-  //   v += weights.dist_weight[src.tok_to_pos[xb]][c];
-  //   v += weights.dist_weight[src.tok_to_pos[xc]][a];   
+  //   v += weights->dist_weight[src.tok_to_pos[xb]][c];
+  //   v += weights->dist_weight[src.tok_to_pos[xc]][a];   
   //   h ^= hash_pos(src.tok_to_pos[xb], c);
   //   h ^= hash_pos(src.tok_to_pos[xc], a);
 
@@ -166,8 +198,8 @@ struct beam_state {
   FORCE_INLINE
   void do_move_src(u8 move) {
     u32 a = src.tok_to_pos[0], b, c;
-    b = puzzle.rot[a][move];
-    c = puzzle.rot[a][(move+(src.direction?5:1))%6];
+    b = puzzle->rot[a][move];
+    c = puzzle->rot[a][(move+(src.direction?5:1))%6];
 
     u32 xb = src.pos_to_tok[b];
     u32 xc = src.pos_to_tok[c];
@@ -199,8 +231,8 @@ struct beam_state {
   FORCE_INLINE
   void do_move_tgt(u8 move){
     u32 a = tgt.tok_to_pos[0], b, c;
-    b = puzzle.rot[a][move];
-    c = puzzle.rot[a][(move+(tgt.direction?5:1))%6];
+    b = puzzle->rot[a][move];
+    c = puzzle->rot[a][(move+(tgt.direction?5:1))%6];
 
     u32 xb = tgt.pos_to_tok[b];
     u32 xc = tgt.pos_to_tok[c];
@@ -245,32 +277,47 @@ struct beam_state {
     return cost.eval();
   }
 
+  // Sets the feature counts of cost from the state.
+  void enable_features() requires TRACK_FEATURES {
+    features_vec V;
+    compute_features(V);
+    FOR(i, NUM_FEATURES) cost.features[i] = V[i];
+  }
+
   void features(features_vec& V) const {
+    if constexpr(TRACK_FEATURES) {
+      FOR(i, NUM_FEATURES) V[i] = cost.features[i];
+    }else{
+      compute_features(V);
+    }
+  }
+
+  void compute_features(features_vec& V) const {
     FOR(i, NUM_FEATURES) V[i] = 0;
-    FORU(u, 1, puzzle.size-1) {
+    FORU(u, 1, puzzle->size-1) {
       u32 x = src.tok_to_pos[u];
       u32 y = tgt.tok_to_pos[u];
-      auto p = puzzle.dist_pair[x][y];
-      V[dist_feature_key[p[0]][p[1]]] += 1;
+      auto p = puzzle->dist_pair[x][y];
+      V[feature_keys->dist[p[0]][p[1]]] += 1;
     }
-    FOR(u, puzzle.size) {
+    FOR(u, puzzle->size) {
       if(!cell_solved[u]) {
-        V[nei_feature_key[cell_nei_solved[u]]] += 1;
+        V[feature_keys->nei[cell_nei_solved[u]]] += 1;
       }
     }
   }
     
   void print() {
-    i32 sz = 1+log10(puzzle.size);
+    i32 sz = 1+log10(puzzle->size);
     string spaces = "";
     FOR(i, sz) spaces += ' ';
   
     i32 ix = 0;
-    FOR(u, 2*puzzle.n-1) {
-      u32 ncol = 2*puzzle.n-1 - abs(u-(puzzle.n-1));
-      FOR(i, abs(u-(puzzle.n-1))) cerr << spaces;
+    FOR(u, 2*puzzle->n-1) {
+      u32 ncol = 2*puzzle->n-1 - abs(u-(puzzle->n-1));
+      FOR(i, abs(u-(puzzle->n-1))) cerr << spaces;
       FOR(icol, ncol) {
-        auto x = puzzle.tgt_pos_to_tok[tgt.tok_to_pos[src.pos_to_tok[ix]]];
+        auto x = puzzle->tgt_pos_to_tok[tgt.tok_to_pos[src.pos_to_tok[ix]]];
         if(src.pos_to_tok[ix] == tgt.pos_to_tok[ix]) {
           cout << "\033[1;32m" << setw(sz) << x << "\033[0m" << spaces;
         }else{
@@ -284,18 +331,112 @@ struct beam_state {
 
 };
 
+using beam_state = basic_beam_state<cost_t>;
+using tracked_beam_state = basic_beam_state<tracked_cost_t>;
+
+// Edges are 0 for going up, or 1+move for going down, packed two per byte
+// (the even edge in the low nibble).
 using euler_tour_edge = u8;
 struct euler_tour {
-  i64 max_size;
+  i64 max_size; // in edges
   i64 size;
-  euler_tour_edge* data;
+  u8* data;
+
+  static i64 bytes(i64 num_edges) { return (num_edges + 1) / 2; }
   
   FORCE_INLINE void reset() { size = 0; }
   FORCE_INLINE void push(i32 x) {
-    data[size++] = x;
+    u8 &b = data[size >> 1];
+    b = (size & 1) ? (b | (x << 4)) : x;
+    size += 1;
+  }
+  FORCE_INLINE euler_tour_edge operator[](i64 ix) const {
+    return (data[ix >> 1] >> ((ix & 1) * 4)) & 15;
+  }
+};
+
+const u32 MIN_HASH_BITS = 16;
+const u32 MAX_HASH_BITS = 28;
+
+// Deterministic mode: hash table entries are the level they were inserted at
+// in the top 16 bits, and the low 48 bits of the state hash, whose low 16 bits
+// are replaced by a tag of the parent that inserted it (the slot already
+// determines them, as there are at least MIN_HASH_BITS). When threads insert
+// the same state, the largest tag wins the slot, and the other copies are
+// not expanded at the next level.
+const u32 DETERMINISTIC_LEVEL_SHIFT = 48;
+const u64 DETERMINISTIC_HASH_MASK = (1ull<<DETERMINISTIC_LEVEL_SHIFT)-1;
+const u64 DETERMINISTIC_OWNER_MASK = (1ull<<16)-1;
+
+FORCE_INLINE
+u64 deterministic_key(u32 level, u64 h, u64 parent_hash) {
+  return ((u64) level << DETERMINISTIC_LEVEL_SHIFT) |
+    (h & DETERMINISTIC_HASH_MASK & ~DETERMINISTIC_OWNER_MASK) |
+    (parent_hash & DETERMINISTIC_OWNER_MASK);
+}
+
+const i64 MIN_TREE_SIZE = 1<<20;
+
+// The search moves its root down the common trunk of the tours once it is at
+// least this long, and strips it from them.
+const u32 REBASE_MIN_TRUNK = 16;
+
+// Recycles the tours of one size, which doubles when a level has too many tours.
+struct tree_pool_t {
+  i64 tree_size = MIN_TREE_SIZE;
+  mutex m;
+  vector<euler_tour> trees;
+  u64 allocated_bytes = 0; // by the trees in use and in the pool
+
+  ~tree_pool_t();
+
+  euler_tour get();
+  void free(euler_tour tree);
+  void increase_size();
+};
+
+inline constinit thread_local tree_pool_t* tree_pool = nullptr;
+
+// Tours from the pool bound to the current thread.
+euler_tour get_new_tree();
+void free_tree(euler_tour tree);
+
+// The tables a search runs on. They are bound to each thread working on it,
+// including the OpenMP workers.
+struct solver_tables {
+  puzzle_data* puzzle;
+  feature_keys_t* feature_keys;
+  weights_t* weights;
+  tree_pool_t* tree_pool;
+
+  static solver_tables current() {
+    return solver_tables {
+      .puzzle = ::puzzle,
+      .feature_keys = ::feature_keys,
+      .weights = ::weights,
+      .tree_pool = ::tree_pool,
+    };
+  }
+
+  void bind() const {
+    ::puzzle = puzzle;
+    ::feature_keys = feature_keys;
+    ::weights = weights;
+    ::tree_pool = tree_pool;
+  }
+};
+
+// Binds tables for the lifetime of the guard, then restores the previous ones.
+struct solver_tables_guard {
+  solver_tables previous;
+
+  solver_tables_guard(solver_tables const& tables)
+    : previous(solver_tables::current()) {
+    tables.bind();
   }
-  FORCE_INLINE u8& operator[](i32 ix) { return data[ix]; }
-  FORCE_INLINE u8 const& operator[](i32 ix) const { return data[ix]; }
+  ~solver_tables_guard() { previous.bind(); }
+
+  solver_tables_guard(solver_tables_guard const&) = delete;
 };
 
 struct beam_search_config {
@@ -303,15 +444,72 @@ struct beam_search_config {
   u32  print_interval;
   u64  width;
   f32  features_save_probability;
+  bool features_save_hard; // prefer states near the cutoff
+  u64  seed; // sampling decisions are a function of the seed and the state
   
   u32  num_threads;
+  u32  hash_bits;
+
+  u32  max_steps = 0; // stop after this many levels, 0 for no limit
+  bool deterministic = false; // same result for a given seed, width and thread count
+  u64  mem_budget = 0; // bytes, the width shrinks when the tours outgrow it, 0 for no limit
+  bool pin_threads = false; // pin the workers, spread over the cpus no other search has pinned
+
+  // Keep up to num_solutions solutions, shortest first, searching at most
+  // solutions_extra_levels levels past the first one for more.
+  u32  num_solutions = 1;
+  u32  solutions_extra_levels = 0;
+
+  // Width of each level as a fraction of width, interpolated between
+  // (progress, fraction) points sorted by progress, where progress is the
+  // part of the initial cost removed by the best state. Empty for a constant width.
+  vector<pair<f32, f32>> width_schedule = {};
+
+  // Set should_stop once the solutions could not be shorter than this
+  // length, which other searches can lower while this one runs.
+  atomic<u32> const* max_solution_length = nullptr;
+
+  // Seconds for the whole search, 0 for no limit. The width (at most
+  // width) is then picked between levels so that the levels left, estimated
+  // from the recent decrease of the cost, fit in the time left.
+  f64 time_budget = 0;
 };
 
+// The fraction of the width at this progress, 1 for an empty schedule.
+f64 width_schedule_fraction(vector<pair<f32, f32>> const& schedule, f64 progress);
+
+// Smallest hash table that is large enough for the given width.
+u32 hash_bits_for_width(u64 width);
+// of the per-thread table of the deterministic mode
+u32 local_hash_bits(beam_search_config const& config);
+
+// Tour edges per kept state, including its children. Measured at about 25
+// for n = 10 and n = 27, at every depth.
+const f64 TOUR_EDGES_PER_STATE = 32;
+
+// Size of the histograms of a search from this state.
+u32 beam_search_max_heur(beam_state const& initial_state);
+
+// Estimated peak memory used by a beam search with the given config.
+// max_heur is the histogram size, 0 if unknown.
+u64 beam_search_memory(beam_search_config const& config, u32 max_heur = 0);
+
+// The config with the largest width (at most config.width if it is set), and
+// the hash table for it, whose estimated memory fits in mem_budget.
+beam_search_config plan_beam_search
+(beam_search_config config,
+ u64 mem_budget,
+ u32 max_heur);
+
 struct beam_search_instance {
   u64* hash_table;
+  u64  hash_mask;
   u32* histogram_heur;
 
-  u32 istep;
+  u32 istep; // depth of the leaves below the root
+  u32 level; // depth of the leaves below the initial state
+  u8  root_last_move_src;
+  u8  root_last_move_tgt;
   
   i32 cutoff_heur;
   f32 cutoff_heur_keep_probability;
@@ -320,41 +518,119 @@ struct beam_search_instance {
   u32 high_heur;
 
   u32 found_solution;
+  // moves from the root to the first solved children of the level
+  u32 max_solutions;
+  vector<vector<u8>> solutions;
+  u64 num_nodes;
+
+  // states whose keyed hash is below the threshold are sampled
+  u64 features_save_key;
+  u64 features_save_threshold;
+  // hard sampling: reservoir size, and decay of the weights away from the cutoff
+  u64 features_save_capacity;
+  f64 features_save_scale;
 
   u8 stack_moves[MAX_SOLUTION_SIZE];
   u8 stack_last_move_src[MAX_SOLUTION_SIZE];
   u8 stack_last_move_tgt[MAX_SOLUTION_SIZE];
 
-  vector<tuple<i32, features_vec > >* saved_features;
+  // Moves from the root that every tour traversed during the level agrees
+  // on: trunk[0..trunk_size), of which trunk_filled have been seen.
+  u32 trunk_size;
+  u32 trunk_filled;
+  u8 trunk[MAX_SOLUTION_SIZE];
+
+  // per-thread samples for the current level, keyed by state hash
+  vector<tuple<u64, features_vec > > saved_features;
+
+  // deterministic mode: the shared hash table is read-only during a level,
+  // new entries are deduplicated in a per-thread table and inserted after it.
+  u64 tour_seed;
+  vector<u64> local_hash_table;
+  vector<pair<u64, u64>> new_hashes; // slot, key
+  vector<pair<u64, u64>> lost_hashes; // slot, key of the entries that lost their slot
+  vector<u64> const* merged_away_keys; // the lost_hashes of the last level, sorted
+
+  // deterministic mode: whether the leaf of hash h, a child of parent_hash,
+  // is a copy of a state that another parent inserted at the last level.
+  bool merged_away(u64 h, u64 parent_hash) const {
+    return !merged_away_keys->empty() &&
+      binary_search(all(*merged_away_keys), deterministic_key(level - 1, h, parent_hash));
+  }
 
+  template<class STATE>
   void traverse_tour
   (beam_search_config const& config,
-   beam_state S,
+   STATE S,
+   euler_tour const& tour_current,
+   vector<euler_tour> &tour_nexts
+   );
+
+  template<bool DETERMINISTIC, class STATE>
+  void traverse_tour_impl
+  (beam_search_config const& config,
+   STATE S,
    euler_tour const& tour_current,
    vector<euler_tour> &tour_nexts
    );
+
+  // Inserts new_hashes into the shared table, keeping the maximum entry of
+  // each slot so that the result does not depend on the thread schedule.
+  // The entries of the level that lose their slot go to lost_hashes.
+  void commit_hashes();
+  // Once every thread committed, keeps in lost_hashes the entries whose
+  // slot holds a copy of the same state from another parent.
+  void check_lost_hashes();
+};
+
+struct beam_search_cutoff {
+  u32 cutoff_heur;
+  f32 keep_probability; // probability of keeping a state at cutoff_heur
+  f64 average_heur;     // average value of the kept states
+  u64 num_children;
 };
 
+// Selects the cutoff keeping the best width states from the histogram,
+// and resets the histogram between low_heur and high_heur.
+beam_search_cutoff select_cutoff
+(u32* histogram_heur,
+ u32 low_heur,
+ u32 high_heur,
+ u64 width,
+ u32 max_heur);
+
 struct beam_search_result_entry {
   i32 step;
   u32 min_cost;
   f32 avg_cost;
+  u64 width; // kept for the next level
 };
 
 struct beam_search_result {
   vector<u8> solution;
+  vector<vector<u8>> solutions; // the collected solutions, shortest first, starting with solution
   vector<tuple<i32, features_vec > > saved_features;
+  // features of the states along the solution, for each level in saved_features
+  vector<tuple<i32, features_vec > > path_features;
 
   vector<beam_search_result_entry> graph;
+  u64 num_nodes; // number of evaluated children
+  bool stopped = false; // by max_solution_length, before a solution was found
 };
 
 struct beam_search {
   beam_search_config config;
-  vector<u64> hash_table;
+  solver_tables tables; // bound when the search was created
+  // Filled in parallel by the workers, so that its pages are spread over the
+  // NUMA nodes instead of all landing on the node of the calling thread.
+  unique_ptr<u64[]> hash_table;
+  u64 hash_size;
   vector<u32> histogram_heur;
+  vector<i32> cpus; // allowed cpus of the process in spread order, for pin_threads
 
   vector<beam_search_instance> L_instances;
   vector<vector<u32>> L_histograms_heur;
+  vector<u64> merged_away_keys; // deterministic mode, see beam_search_instance
 
   bool should_stop;
 
@@ -364,4 +640,10 @@ struct beam_search {
   beam_search(beam_search const& other) = delete;
   
   beam_search_result search(beam_state const& initial_state);
+
+  // The search from root, on tracked states when sampling features.
+  template<class STATE>
+  beam_search_result search_impl(STATE root, u32 max_heur);
+
+  void fill_hash_table(u64 value);
 };
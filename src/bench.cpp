@@ -0,0 +1,396 @@
+#include "header.hpp"
+#include "puzzle.hpp"
+#include "eval.hpp"
+#include "beam_search.hpp"
+#include "solver.hpp"
+#include <omp.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <argparse/argparse.hpp>
+
+// Microbenchmarks for the beam search hot paths.
+
+const u32 BENCH_REPEATS = 5;
+const u32 BENCH_MOVES = 1<<20;
+
+struct bench_result {
+  string name;
+  i32 n;
+  f64 ns_per_op;
+  u64 ops;
+  f64 misses_per_op = -1; // last level cache misses, -1 if the counters are unavailable
+};
+
+volatile u64 bench_sink;
+
+// Hardware cache miss counters, one per OpenMP thread. OpenMP reuses its
+// threads between regions of the same size, so the counters follow the
+// workers of the measured code.
+struct cache_miss_counters {
+  vector<i32> fds;
+
+  explicit cache_miss_counters(u32 num_threads) {
+    fds.assign(num_threads, -1);
+#pragma omp parallel num_threads(num_threads)
+    {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fds[omp_get_thread_num()] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+  }
+
+  ~cache_miss_counters() {
+    for(auto fd : fds) if(fd >= 0) close(fd);
+  }
+
+  bool available() const {
+    return all_of(all(fds), [](i32 fd) { return fd >= 0; });
+  }
+
+  void start() {
+    for(auto fd : fds) if(fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  // total misses since start, -1 if unavailable
+  i64 stop() {
+    i64 total = 0;
+    for(auto fd : fds) if(fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      u64 count = 0;
+      if(read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+      total += count;
+    }
+    return available() ? total : -1;
+  }
+};
+
+// Runs setup() then body() BENCH_REPEATS times, body returns the number of operations.
+// Reports the median time per operation.
+template<class S, class B>
+bench_result run_bench(string const& name, S setup, B body) {
+  vector<f64> ns;
+  u64 ops = 0;
+  FOR(r, BENCH_REPEATS) {
+    setup();
+    timer t;
+    ops = body();
+    ns.pb(1e9 * t.elapsed() / max<u64>(1, ops));
+  }
+  sort(all(ns));
+  auto result = bench_result {
+    .name = name,
+    .n = puzzle->n,
+    .ns_per_op = ns[ns.size()/2],
+    .ops = ops,
+  };
+
+  // one more run for the counters, outside of the timings
+  cache_miss_counters counters(1);
+  if(counters.available()) {
+    setup();
+    counters.start();
+    u64 ops = body();
+    result.misses_per_op = (f64) counters.stop() / max<u64>(1, ops);
+  }
+
+  cerr
+    << setw(24) << name << " n = " << setw(2) << puzzle->n
+    << ": " << setw(12) << setprecision(2) << fixed << result.ns_per_op << " ns/op";
+  if(result.misses_per_op >= 0) {
+    cerr << ", " << setprecision(3) << result.misses_per_op << " misses/op";
+  }
+  cerr << endl;
+  return result;
+}
+
+vector<u8> random_moves(u32 count, u32 num_moves) {
+  RNG moves_rng(0);
+  vector<u8> moves(count);
+  for(auto &m : moves) m = moves_rng.random32(num_moves);
+  return moves;
+}
+
+void bench_moves(vector<bench_result>& results) {
+  beam_state S;
+  S.generate(0);
+
+  { auto moves = random_moves(BENCH_MOVES, 6);
+    puzzle_state P = S.src;
+    results.pb(run_bench("puzzle_state::do_move", []{}, [&]{
+      for(auto m : moves) P.do_move(m);
+      bench_sink = P.tok_to_pos[0];
+      return moves.size();
+    }));
+  }
+
+  { auto moves = random_moves(BENCH_MOVES, 12);
+    beam_state T = S;
+    results.pb(run_bench("beam_state::do_move", []{}, [&]{
+      for(auto m : moves) T.do_move(m);
+      bench_sink = T.hash;
+      return moves.size();
+    }));
+    results.pb(run_bench("beam_state::plan_move", []{}, [&]{
+      u64 h = 0;
+      for(auto m : moves) {
+        auto [v, hm, solved] = T.plan_move(m);
+        h += hm + v;
+      }
+      bench_sink = h;
+      return moves.size();
+    }));
+  }
+
+  { beam_state T = S;
+    u32 count = max<u32>(64, (1<<22) / puzzle->size);
+    results.pb(run_bench("beam_state::init", []{}, [&]{
+      FOR(i, count) T.init();
+      bench_sink = T.hash;
+      return count;
+    }));
+  }
+}
+
+void bench_traverse_tour(vector<bench_result>& results) {
+  const u32 depth = 5;
+
+  beam_state S;
+  S.generate(0);
+
+  auto config = beam_search_config {
+    .print = false,
+    .print_interval = 1,
+    .width = 0,
+    .features_save_probability = 0.0,
+    .features_save_hard = false,
+    .seed = 0,
+    .num_threads = 1,
+    .hash_bits = 22,
+  };
+
+  u32 max_heur = S.value() * 1.2 + 1024;
+  vector<u64> hash_table(1ull<<config.hash_bits);
+  vector<u32> histogram_heur(max_heur, 0);
+  auto instance = make_unique<beam_search_instance>();
+  instance->hash_table = hash_table.data();
+  instance->hash_mask = hash_table.size() - 1;
+  instance->histogram_heur = histogram_heur.data();
+  instance->cutoff_heur = max_heur;
+  instance->cutoff_heur_keep_probability = 1.0;
+  instance->features_save_key = 0;
+  instance->features_save_threshold = 0;
+  instance->features_save_capacity = 0;
+  instance->features_save_scale = 1.0;
+  // from the initial state, as search does, without tracking the trunk
+  instance->root_last_move_src = 12;
+  instance->root_last_move_tgt = 12;
+  instance->trunk_size = 0;
+  instance->trunk_filled = 0;
+  instance->max_solutions = 1;
+
+  auto traverse = [&](u32 istep, vector<euler_tour> const& tours) {
+    vector<euler_tour> tours_next;
+    instance->istep = istep;
+    instance->low_heur = max_heur;
+    instance->high_heur = 0;
+    instance->found_solution = false;
+    instance->num_nodes = 0;
+    for(auto const& tour : tours) {
+      instance->traverse_tour(config, S, tour, tours_next);
+    }
+    fill(all(histogram_heur), 0);
+    return tours_next;
+  };
+
+  // all states at the given depth, keeping every child
+  fill(all(hash_table), rng.randomInt64());
+  vector<euler_tour> tours = { get_new_tree() };
+  tours.back().push(0);
+  FOR(istep, depth) {
+    auto tours_next = traverse(istep, tours);
+    for(auto tour : tours) free_tree(tour);
+    tours = tours_next;
+  }
+
+  vector<euler_tour> tours_next;
+  results.pb(run_bench("traverse_tour", [&]{
+    for(auto tour : tours_next) free_tree(tour);
+    fill(all(hash_table), rng.randomInt64());
+  }, [&]{
+    tours_next = traverse(depth, tours);
+    return instance->num_nodes;
+  }));
+  for(auto tour : tours_next) free_tree(tour);
+  for(auto tour : tours) free_tree(tour);
+
+  // cutoff selection over a histogram of random children values
+  { RNG values_rng(0);
+    u32 low = S.value() / 2, high = min<u32>(max_heur-1, S.value());
+    u32 count = 1<<16;
+    vector<u32> values(count);
+    for(auto &v : values) v = values_rng.randomRange32(low, high);
+    results.pb(run_bench("select_cutoff", [&]{
+      for(auto v : values) histogram_heur[v] += 1;
+    }, [&]{
+      auto cutoff = select_cutoff(histogram_heur.data(), low, high, count / 8, max_heur);
+      bench_sink = cutoff.cutoff_heur;
+      return 1;
+    }));
+  }
+}
+
+bench_result bench_search(u32 width, u32 steps, bool pin_threads) {
+  beam_state S;
+  S.generate(0);
+
+  auto search = make_unique<beam_search>(beam_search_config {
+      .print = false,
+      .print_interval = 1,
+      .width = width,
+      .features_save_probability = 0.0,
+      .features_save_hard = false,
+      .seed = 0,
+      .num_threads = (u32)omp_get_max_threads(),
+      .hash_bits = hash_bits_for_width(width),
+      .max_steps = steps,
+      .pin_threads = pin_threads,
+    });
+
+  cache_miss_counters counters(search->config.num_threads);
+  counters.start();
+  timer t;
+  auto result = search->search(S);
+  f64 elapsed = t.elapsed();
+  i64 misses = counters.stop();
+  f64 misses_per_node = misses >= 0 ? (f64) misses / max<u64>(1, result.num_nodes) : -1;
+
+  cerr
+    << setw(24) << "search" << " n = " << setw(2) << puzzle->n
+    << ": " << setw(12) << setprecision(2) << fixed << 1e9 * elapsed / max<u64>(1, result.num_nodes) << " ns/node"
+    << ", " << setprecision(0) << fixed << result.num_nodes / elapsed << " nodes/s"
+    << ", " << setprecision(2) << fixed << result.graph.size() / elapsed << " levels/s";
+  if(misses_per_node >= 0) {
+    cerr << ", " << setprecision(3) << misses_per_node << " misses/node";
+  }
+  cerr << endl;
+
+  return bench_result {
+    .name = "search",
+    .n = puzzle->n,
+    .ns_per_op = 1e9 * elapsed / max<u64>(1, result.num_nodes),
+    .ops = result.num_nodes,
+    .misses_per_op = misses_per_node,
+  };
+}
+
+int main(int argc, char** argv) {
+  argparse::ArgumentParser program("bench");
+
+  program.add_argument("--n")
+    .nargs(argparse::nargs_pattern::at_least_one)
+    .default_value(vector<string>{"5", "10", "15", "20", "27"});
+
+  program.add_argument("--width")
+    .scan<'u', u32>()
+    .default_value(10'000u);
+
+  program.add_argument("--steps")
+    .scan<'u', u32>()
+    .default_value(100u);
+
+  program.add_argument("--filter")
+    .default_value("");
+
+  program.add_argument("--json")
+    .default_value("");
+
+  program.add_argument("--pin")
+    .default_value(false)
+    .implicit_value(true);
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::exception& err) {
+    cerr << err.what() << endl;
+    cerr << program;
+    return 1;
+  }
+
+  u32 width = program.get<u32>("width");
+  u32 steps = program.get<u32>("steps");
+  string filter = program.get("filter");
+  auto enabled = [&](string const& name) {
+    return name.find(filter) != string::npos;
+  };
+  auto any_enabled = [&](vector<string> const& names) {
+    return any_of(all(names), enabled);
+  };
+
+  vector<bench_result> results;
+  for(auto const& sn : program.get<vector<string>>("n")) {
+    i32 n = stoi(sn);
+    runtime_assert(3 <= n && n <= 27);
+    solver_context context(n);
+    solver_tables_guard guard(context.tables());
+
+    if(any_enabled({"puzzle_state::do_move", "beam_state::do_move",
+                    "beam_state::plan_move", "beam_state::init"})) {
+      bench_moves(results);
+    }
+    if(any_enabled({"traverse_tour", "select_cutoff"})) {
+      bench_traverse_tour(results);
+    }
+    if(enabled("search")) {
+      results.pb(bench_search(width, steps, program.get<bool>("pin")));
+    }
+  }
+  erase_if(results, [&](auto const& r) { return !enabled(r.name); });
+
+  char hostname[256] = {0};
+  gethostname(hostname, sizeof(hostname)-1);
+
+  ostringstream os;
+  os << "{\n"
+     << "  \"host\": \"" << hostname << "\",\n"
+     << "  \"threads\": " << omp_get_max_threads() << ",\n"
+     << "  \"width\": " << width << ",\n"
+     << "  \"steps\": " << steps << ",\n"
+     << "  \"pin\": " << (program.get<bool>("pin") ? "true" : "false") << ",\n"
+     << "  \"results\": [\n";
+  FOR(i, results.size()) {
+    auto const& r = results[i];
+    os << "    {\"name\": \"" << r.name << "\""
+       << ", \"n\": " << r.n
+       << ", \"ns_per_op\": " << setprecision(3) << fixed << r.ns_per_op
+       << ", \"ops\": " << r.ops;
+    if(r.misses_per_op >= 0) {
+      os << ", \"misses_per_op\": " << setprecision(4) << fixed << r.misses_per_op;
+    }else{
+      os << ", \"misses_per_op\": null";
+    }
+    os << "}" << (i+1 < (i32)results.size() ? "," : "") << "\n";
+  }
+  os << "  ]\n}\n";
+
+  string json = program.get("json");
+  if(json.empty()) {
+    cout << os.str();
+  }else{
+    ofstream out(json);
+    runtime_assert(out.good());
+    out << os.str();
+  }
+
+  return 0;
+}
@@ -1,8 +1,14 @@
 #include "eval.hpp"
+#include <omp.h>
+
+// The size^2 passes below run in parallel. The workers read the tables
+// through references taken here, as they are not bound to the context.
 
 void weights_t::init(){
-  FOR(u, puzzle.size) FOR(v, puzzle.size) {
-    dist_weight[u][v] = puzzle.dist_eval[u][v];
+  auto const& P = *puzzle;
+#pragma omp parallel for schedule(static)
+  FOR(u, P.size) FOR(v, P.size) {
+    dist_weight[u][v] = P.dist_eval[u][v];
   }
   FOR(m, 1<<6) {
     nei_weight[m] = 0;
@@ -10,21 +16,140 @@ void weights_t::init(){
 }
 
 void weights_t::from_weights(weights_vec const& w) {
-  FOR(u, puzzle.size) FOR(v, puzzle.size) {
-    auto p = puzzle.dist_pair[u][v];
-    dist_weight[u][v] = EVAL_SCALE * w[dist_feature_key[p[0]][p[1]]];
+  u32 scaled[NUM_FEATURES];
+  FOR(i, NUM_FEATURES) scaled[i] = EVAL_SCALE * w[i];
+  auto const& P = *puzzle;
+  auto const& K = *feature_keys;
+#pragma omp parallel for schedule(static)
+  FOR(u, P.size) FOR(v, P.size) {
+    dist_weight[u][v] = scaled[K.pos[u][v]];
   }
   FOR(m, bit(6)) {
-    nei_weight[m] = EVAL_SCALE * w[nei_feature_key[m]];
+    nei_weight[m] = EVAL_SCALE * w[feature_keys->nei[m]];
+  }
+}
+
+const char WEIGHTS_MAGIC[8] = {'B','A','L','T','W','T','S','1'};
+const u32 WEIGHTS_VERSION = 1;
+
+u64 fnv1a(string const& data) {
+  u64 h = 0xcbf29ce484222325ull;
+  for(u8 c : data) {
+    h ^= c;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+void save_weights(string const& filename, weights_file const& file) {
+  ostringstream os;
+  auto put = [&](auto const& x) { os.write((char const*)&x, sizeof(x)); };
+  os.write(WEIGHTS_MAGIC, sizeof(WEIGHTS_MAGIC));
+  put(WEIGHTS_VERSION);
+  put(file.n);
+  put(NUM_FEATURES_DIST);
+  put(NUM_FEATURES_NEI);
+  put(file.gather_width);
+  put(file.gather_count);
+  put(file.features_save_probability);
+  put(file.training_iters);
+  put(file.num_samples);
+  put(file.w);
+  string data = os.str();
+  u64 checksum = fnv1a(data);
+
+  ofstream out(filename, ios::binary);
+  runtime_assert(out.good());
+  out.write(data.data(), data.size());
+  out.write((char const*)&checksum, sizeof(checksum));
+  runtime_assert(out.good());
+}
+
+weights_file load_weights(string const& filename) {
+  ifstream in(filename, ios::binary);
+  runtime_assert(in.good());
+  string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+  weights_file file;
+  if(data.size() < sizeof(WEIGHTS_MAGIC) ||
+     !equal(WEIGHTS_MAGIC, WEIGHTS_MAGIC + 8, data.data())) {
+    // legacy raw weights_vec
+    runtime_assert(data.size() >= sizeof(weights_vec));
+    memcpy(&file.w, data.data(), sizeof(weights_vec));
+    return file;
   }
+
+  runtime_assert(data.size() >= sizeof(u64));
+  u64 checksum;
+  memcpy(&checksum, data.data() + data.size() - sizeof(u64), sizeof(u64));
+  data.resize(data.size() - sizeof(u64));
+  runtime_assert(checksum == fnv1a(data));
+
+  istringstream is(data);
+  auto get = [&](auto& x) { is.read((char*)&x, sizeof(x)); };
+  char magic[8];
+  u32 version, num_features_dist, num_features_nei;
+  is.read(magic, sizeof(magic));
+  get(version);
+  runtime_assert(version == WEIGHTS_VERSION);
+  get(file.n);
+  get(num_features_dist);
+  get(num_features_nei);
+  runtime_assert(num_features_dist == NUM_FEATURES_DIST);
+  runtime_assert(num_features_nei == NUM_FEATURES_NEI);
+  get(file.gather_width);
+  get(file.gather_count);
+  get(file.features_save_probability);
+  get(file.training_iters);
+  get(file.num_samples);
+  get(file.w);
+  runtime_assert(is.good());
+  return file;
+}
+
+weights_vec resize_weights(weights_file const& file, i32 n) {
+  weights_vec w = file.w;
+  if(file.n == 0 || file.n >= n) return w;
+
+  // fit F(dx,dy) = a * (dx*dx+dx*dy+dy*dy) + b * (dx+dy) on the trained features
+  f64 s11 = 0, s12 = 0, s22 = 0, t1 = 0, t2 = 0;
+  FOR(u, file.n) FOR(v, u+1) if(u+v < file.n && u+v > 0) {
+    f64 x1 = u*u+u*v+v*v, x2 = u+v, y = w[feature_keys->dist[u][v]];
+    s11 += x1*x1; s12 += x1*x2; s22 += x2*x2;
+    t1 += x1*y; t2 += x2*y;
+  }
+  f64 det = s11*s22 - s12*s12;
+  f64 a = 0, b = 0;
+  if(abs(det) > 1e-9) {
+    a = (t1*s22 - t2*s12) / det;
+    b = (s11*t2 - s12*t1) / det;
+  }
+
+  // extrapolate, keeping the weights monotonic as in update_weights
+  FOR(u, n) FOR(v, u+1) if(u+v < n && u+v >= file.n) {
+    f64 &x = w[feature_keys->dist[u][v]];
+    x = max(0.0, a * (u*u+u*v+v*v) + b * (u+v));
+    if(u > 0 && v < u) x = max(x, w[feature_keys->dist[u-1][v]]);
+    if(v > 0) x = max(x, w[feature_keys->dist[u][v-1]]);
+  }
+
+  return w;
 }
 
 void init_features() {
   i32 next_feature = 0;
   FOR(x, 27) FOR(y, x+1) if(x+y < 27) {
-    dist_feature_key[x][y] = next_feature++;
+    feature_keys->dist[x][y] = next_feature++;
   }
   runtime_assert(next_feature == NUM_FEATURES_DIST);
+
+  auto const& P = *puzzle;
+  auto &K = *feature_keys;
+#pragma omp parallel for schedule(static)
+  FOR(u, P.size) FOR(v, P.size) {
+    auto p = P.dist_pair[u][v];
+    K.pos[u][v] = K.dist[p[0]][p[1]];
+  }
   
   FOR(mask, bit(6)) {
     bool bits[6];
@@ -41,9 +166,9 @@ void init_features() {
       min_mask = min(min_mask, mask2);
     }
     if(min_mask == (u32)mask) {
-      nei_feature_key[mask] = next_feature++;
+      feature_keys->nei[mask] = next_feature++;
     }else{
-      nei_feature_key[mask] = nei_feature_key[min_mask];
+      feature_keys->nei[mask] = feature_keys->nei[min_mask];
     }
   }
   runtime_assert(next_feature ==
@@ -56,5 +181,5 @@ void init_features() {
 
 void init_eval() {
   init_features();
-  weights.init();
+  weights->init();
 }
@@ -14,8 +14,18 @@ const u32 NUM_FEATURES =
 using weights_vec = array<f64, NUM_FEATURES>;
 using features_vec = array<i64, NUM_FEATURES>;
 
-inline u32 dist_feature_key[MAX_SIZE][MAX_SIZE];
-inline u32 nei_feature_key[1<<6];
+static_assert(NUM_FEATURES <= 256);
+
+struct feature_keys_t {
+  u32 dist[MAX_SIZE][MAX_SIZE];
+  u32 nei[1<<6];
+
+  // feature key of a token at position x, with target position y
+  u8  pos[MAX_SIZE][MAX_SIZE];
+};
+
+// Tables of the solver context bound to the current thread.
+inline constinit thread_local feature_keys_t* feature_keys = nullptr;
 
 struct weights_t {
   u32 dist_weight[MAX_SIZE][MAX_SIZE];
@@ -25,33 +35,71 @@ struct weights_t {
   void from_weights(weights_vec const& t);
 };
 
-inline weights_t weights;
+inline constinit thread_local weights_t* weights = nullptr;
+
+// Weights file, with the board size and training metadata.
+// Version 1 layout:
+//   magic "BALTWTS1", version (u32), n (i32),
+//   NUM_FEATURES_DIST (u32), NUM_FEATURES_NEI (u32),
+//   gather_width (u32), gather_count (u32), features_save_probability (f32),
+//   training_iters (u32), num_samples (u64),
+//   weights (f64[NUM_FEATURES]), FNV-1a checksum of the preceding bytes (u64).
+// Files without the magic are raw weights_vec blobs, with n = 0 (unknown).
+struct weights_file {
+  i32 n = 0;
+
+  u32 gather_width = 0;
+  u32 gather_count = 0;
+  f32 features_save_probability = 0;
+  u32 training_iters = 0;
+  u64 num_samples = 0;
+
+  weights_vec w;
+};
+
+void save_weights(string const& filename, weights_file const& file);
+weights_file load_weights(string const& filename);
 
-struct cost_t {
+// Weights for board size n. Distance features that were not reachable
+// on the board the file was trained for are extrapolated, so weights
+// trained on a smaller n can be used to warm start a larger one.
+weights_vec resize_weights(weights_file const& file, i32 n);
+
+// Cost of a state, updated with the moves. With TRACK_FEATURES, the counts
+// of the features are maintained as well, for gathering training samples.
+template<bool TRACK_FEATURES>
+struct basic_cost_t {
   i32 cost;
+  [[no_unique_address]]
+  conditional_t<TRACK_FEATURES, array<i32, NUM_FEATURES>, tuple<>> features;
 
   void reset() {
     cost = 0;
+    if constexpr(TRACK_FEATURES) features.fill(0);
   }
   
   FORCE_INLINE
   void add_dist(i32 x, i32 y) {
-    cost += weights.dist_weight[x][y];
+    cost += weights->dist_weight[x][y];
+    if constexpr(TRACK_FEATURES) features[feature_keys->pos[x][y]] += 1;
   }
   
   FORCE_INLINE
   void rem_dist(i32 x, i32 y) {
-    cost -= weights.dist_weight[x][y];
+    cost -= weights->dist_weight[x][y];
+    if constexpr(TRACK_FEATURES) features[feature_keys->pos[x][y]] -= 1;
   }
 
   FORCE_INLINE
   void add_nei(i32 x) {
-    cost += weights.nei_weight[x];
+    cost += weights->nei_weight[x];
+    if constexpr(TRACK_FEATURES) features[feature_keys->nei[x]] += 1;
   }
   
   FORCE_INLINE
   void rem_nei(i32 x) {
-    cost -= weights.nei_weight[x];
+    cost -= weights->nei_weight[x];
+    if constexpr(TRACK_FEATURES) features[feature_keys->nei[x]] -= 1;
   }
   
   FORCE_INLINE
@@ -60,4 +108,9 @@ struct cost_t {
   }
 };
 
+using cost_t = basic_cost_t<false>;
+using tracked_cost_t = basic_cost_t<true>;
+
+static_assert(sizeof(cost_t) == sizeof(i32));
+
 void init_eval();
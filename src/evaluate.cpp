@@ -0,0 +1,68 @@
+#include "evaluate.hpp"
+#include "solver.hpp"
+
+evaluate_result evaluate_current_weights(evaluate_config const& config) {
+  auto batch = solve_batch(batch_config {
+      .width = config.width,
+      .threads_per_search = config.threads_per_search,
+      .seed = 0,
+      .deterministic = config.deterministic,
+      .print = false,
+      .output = "",
+    }, config.num_seeds, [&](u64 i) {
+      beam_state state;
+      state.generate(config.first_seed + i);
+      return state;
+    });
+
+  f64 total2 = 0;
+  for(auto const& solution : batch.solutions) {
+    total2 += (f64)solution.size() * solution.size();
+  }
+  u32 count = config.num_seeds - batch.failures;
+  f64 mean = batch.mean_length;
+
+  return evaluate_result {
+    .mean = mean,
+    .std = sqrt(max(0.0, total2 / max(1u, count) - mean*mean)),
+    .failures = batch.failures,
+    .nodes_per_second = batch.nodes_per_second,
+    .elapsed = batch.elapsed,
+  };
+}
+
+void evaluate_weights(evaluate_config const& config) {
+  cerr
+    << "evaluate: " << config.num_seeds << " seeds, width = " << config.width
+    << endl;
+
+  vector<tuple<string, evaluate_result>> entries;
+  for(auto const& filename : config.weights) {
+    weights->from_weights(resize_weights(load_weights(filename), puzzle->n));
+    auto result = evaluate_current_weights(config);
+    entries.eb(filename, result);
+
+    cerr
+      << filename
+      << ": length = " << setprecision(2) << fixed << result.mean << " ± " << result.std
+      << ", failures = " << result.failures
+      << ", nodes/s = " << setprecision(0) << fixed << result.nodes_per_second
+      << ", elapsed = " << setprecision(2) << fixed << result.elapsed << "s"
+      << endl;
+  }
+
+  sort(all(entries), [&](auto const& a, auto const& b) {
+    return mt(get<1>(a).failures, get<1>(a).mean) < mt(get<1>(b).failures, get<1>(b).mean);
+  });
+
+  cout << "rank weights mean std failures nodes/s" << endl;
+  FOR(i, entries.size()) {
+    auto const& [filename, e] = entries[i];
+    cout
+      << i+1 << ' ' << filename << ' '
+      << setprecision(2) << fixed << e.mean << ' ' << e.std << ' '
+      << e.failures << ' '
+      << setprecision(0) << fixed << e.nodes_per_second
+      << endl;
+  }
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "header.hpp"
+#include "puzzle.hpp"
+
+struct evaluate_config {
+  vector<string> weights;
+  u32 width;
+  u32 num_seeds;
+  u64 first_seed;
+  u32 threads_per_search; // 0 to pick from the width
+  bool deterministic = false;
+};
+
+struct evaluate_result {
+  f64 mean;
+  f64 std;
+  u32 failures;
+  f64 nodes_per_second;
+  f64 elapsed;
+};
+
+// Runs the current weights on the seeds of the config.
+evaluate_result evaluate_current_weights(evaluate_config const& config);
+
+// Runs every weights file on the same seeds, and prints the solution lengths.
+void evaluate_weights(evaluate_config const& config);
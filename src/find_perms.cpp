@@ -1,8 +1,10 @@
 #include "find_perms.hpp"
 #include "puzzle.hpp"
+#include "solver.hpp"
 
 void find_perms() {
-  puzzle.make(10);
+  solver_context context(10);
+  solver_tables_guard guard(context.tables());
 
   puzzle_state S; S.set_tgt();
   i64 count = 0;
@@ -12,11 +14,11 @@ void find_perms() {
   
   auto bt = [&](auto self, i32 i, u8 last, i32 limit) -> void {
     if(i == limit) {
-      if(S.pos_to_tok[puzzle.center] == 0) {
+      if(S.pos_to_tok[puzzle->center] == 0) {
         i32 sz = 0;
         vector<array<i32, 2>> P;
         
-        FOR(u, puzzle.size) if((i32)S.pos_to_tok[u] != puzzle.tgt_pos_to_tok[u]) {
+        FOR(u, puzzle->size) if((i32)S.pos_to_tok[u] != puzzle->tgt_pos_to_tok[u]) {
           P.pb({u, (i32)S.pos_to_tok[u]});
           sz += 1;
         }
@@ -3,6 +3,8 @@
 #include "eval.hpp"
 #include "training.hpp"
 #include "solver.hpp"
+#include "evaluate.hpp"
+#include "server.hpp"
 #include <omp.h>
 #include <argparse/argparse.hpp>
 
@@ -35,23 +37,141 @@ int main(int argc, char** argv) {
     .scan<'u', u32>()
     .default_value(1'000'000u);
 
+  train_cmd.add_argument("--threads")
+    .scan<'u', u32>()
+    .default_value(1u);
+
+  train_cmd.add_argument("--mem-budget")
+    .scan<'u', u32>()
+    .default_value(0u);
+
   train_cmd.add_argument("--ratio")
     .scan<'f', f32>()
     .default_value(0.001f);
 
+  train_cmd.add_argument("--hard")
+    .default_value(false)
+    .implicit_value(true);
+
   train_cmd.add_argument("--print")
     .default_value(false)
     .implicit_value(true);
 
+  train_cmd.add_argument("--samples")
+    .default_value("");
+
   train_cmd.add_argument("-o", "--output")
     .default_value("");
+
+  argparse::ArgumentParser gather_cmd("gather");
+  program.add_subparser(gather_cmd);
+
+  gather_cmd.add_argument("--width")
+    .scan<'u', u32>()
+    .default_value(1u<<10);
+
+  gather_cmd.add_argument("--count")
+    .scan<'u', u32>()
+    .default_value(1'000'000u);
+
+  gather_cmd.add_argument("--threads")
+    .scan<'u', u32>()
+    .default_value(1u);
+
+  gather_cmd.add_argument("--mem-budget")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  gather_cmd.add_argument("--ratio")
+    .scan<'f', f32>()
+    .default_value(0.001f);
+
+  gather_cmd.add_argument("--hard")
+    .default_value(false)
+    .implicit_value(true);
+
+  gather_cmd.add_argument("--print")
+    .default_value(false)
+    .implicit_value(true);
+
+  gather_cmd.add_argument("-o", "--output")
+    .required();
   
+  argparse::ArgumentParser sweep_cmd("sweep");
+  program.add_subparser(sweep_cmd);
+
+  sweep_cmd.add_argument("--samples")
+    .required();
+
+  sweep_cmd.add_argument("--iters")
+    .scan<'u', u32>()
+    .default_value(1000u);
+
+  for(auto [name, value] : {
+      pair{"--alpha", "1"},
+      pair{"--beta1", "0.9"},
+      pair{"--beta2", "0.999"},
+      pair{"--lambda", "1e-7"},
+      pair{"--batch", "65536"},
+      pair{"--init-scale", "10"},
+    }) {
+    sweep_cmd.add_argument(name)
+      .nargs(argparse::nargs_pattern::at_least_one)
+      .default_value(vector<string>{value});
+  }
+
+  sweep_cmd.add_argument("--holdout")
+    .scan<'f', f32>()
+    .default_value(0.1f);
+
+  sweep_cmd.add_argument("--eval-width")
+    .scan<'u', u32>()
+    .default_value(256u);
+
+  sweep_cmd.add_argument("--eval-seeds")
+    .scan<'u', u32>()
+    .default_value(8u);
+
+  sweep_cmd.add_argument("-o", "--output")
+    .default_value("");
+
+  argparse::ArgumentParser evaluate_cmd("evaluate");
+  program.add_subparser(evaluate_cmd);
+
+  evaluate_cmd.add_argument("--weights")
+    .required()
+    .nargs(argparse::nargs_pattern::at_least_one);
+
+  evaluate_cmd.add_argument("--width")
+    .required()
+    .scan<'u', u32>();
+
+  evaluate_cmd.add_argument("--seeds")
+    .scan<'u', u32>()
+    .default_value(16u);
+
+  evaluate_cmd.add_argument("--first-seed")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  evaluate_cmd.add_argument("--threads")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  evaluate_cmd.add_argument("--deterministic")
+    .default_value(false)
+    .implicit_value(true);
+
   argparse::ArgumentParser solve_cmd("solve");
   program.add_subparser(solve_cmd);
 
   solve_cmd.add_argument("--width")
-    .required()
-    .scan<'u', u32>();
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  solve_cmd.add_argument("--mem-budget")
+    .scan<'u', u32>()
+    .default_value(0u);
 
   solve_cmd.add_argument("--dir")
     .scan<'u', u32>()
@@ -59,7 +179,116 @@ int main(int argc, char** argv) {
 
   solve_cmd.add_argument("--output-graph")
     .default_value("");
+
+  solve_cmd.add_argument("--seed")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  solve_cmd.add_argument("--deterministic")
+    .default_value(false)
+    .implicit_value(true);
+
+  solve_cmd.add_argument("--pin")
+    .default_value(false)
+    .implicit_value(true);
+
+  solve_cmd.add_argument("--solutions")
+    .scan<'u', u32>()
+    .default_value(1u);
+
+  solve_cmd.add_argument("--extra-levels")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  solve_cmd.add_argument("--width-schedule")
+    .default_value("");
+
+  solve_cmd.add_argument("--time-budget")
+    .scan<'f', f32>()
+    .default_value(0.0f);
+
+  solve_cmd.add_argument("--input")
+    .default_value("");
  
+  argparse::ArgumentParser portfolio_cmd("portfolio");
+  program.add_subparser(portfolio_cmd);
+
+  // empty for the weights of --load
+  portfolio_cmd.add_argument("--weights")
+    .nargs(argparse::nargs_pattern::at_least_one)
+    .default_value(vector<string>{""});
+
+  portfolio_cmd.add_argument("--dirs")
+    .nargs(argparse::nargs_pattern::at_least_one)
+    .scan<'u', u32>()
+    .default_value(vector<u32>{0});
+
+  portfolio_cmd.add_argument("--width")
+    .required()
+    .scan<'u', u32>();
+
+  portfolio_cmd.add_argument("--threads")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  portfolio_cmd.add_argument("--seed")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  portfolio_cmd.add_argument("--output-graph")
+    .default_value("");
+
+  argparse::ArgumentParser batch_cmd("batch");
+  program.add_subparser(batch_cmd);
+
+  batch_cmd.add_argument("--width")
+    .required()
+    .scan<'u', u32>();
+
+  batch_cmd.add_argument("--input")
+    .default_value("");
+
+  batch_cmd.add_argument("--generate")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  batch_cmd.add_argument("--first-seed")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  batch_cmd.add_argument("--dir")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  batch_cmd.add_argument("--threads")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  batch_cmd.add_argument("--seed")
+    .scan<'u', u32>()
+    .default_value(0u);
+
+  batch_cmd.add_argument("--deterministic")
+    .default_value(false)
+    .implicit_value(true);
+
+  batch_cmd.add_argument("--print")
+    .default_value(false)
+    .implicit_value(true);
+
+  batch_cmd.add_argument("-o", "--output")
+    .default_value("");
+
+  argparse::ArgumentParser server_cmd("server");
+  program.add_subparser(server_cmd);
+
+  server_cmd.add_argument("--socket")
+    .default_value("");
+
+  server_cmd.add_argument("--max-contexts")
+    .scan<'u', u32>()
+    .default_value(4u);
+
   try {
     program.parse_args(argc, argv);
   } catch (const std::exception& err) {
@@ -68,19 +297,50 @@ int main(int argc, char** argv) {
     return 1;
   }
   
+  // the server makes the tables of each board size on demand
+  if(program.is_subcommand_used(server_cmd)) {
+    serve(server_config {
+        .socket_path = server_cmd.get<string>("socket"),
+        .max_contexts = server_cmd.get<u32>("max-contexts"),
+      });
+    return 0;
+  }
+
   auto n = program.get<int>("n");
   runtime_assert(3 <= n && n <= 27);
 
-  puzzle.make(n);
-  init_eval();
+  solver_context context(n);
+  context.tables().bind();
+
+  // the states of size n in a file in the format of StartingConfigurations.txt, - for stdin
+  auto read_states = [&](string const& filename) {
+    vector<tuple<i32, puzzle_state>> states;
+    if(filename == "-") {
+      states = read_configurations(cin);
+    }else{
+      ifstream is(filename);
+      if(!is.good()) throw runtime_error("cannot open " + filename);
+      states = read_configurations(is);
+    }
+    vector<puzzle_state> result;
+    for(auto const& [m, state] : states) if(m == n) result.pb(state);
+    if(result.size() < states.size()) {
+      cerr << "skipped " << states.size() - result.size() << " states of another size" << endl;
+    }
+    return result;
+  };
 
-  string load_weights = program.get("load");
-  if(!load_weights.empty()) {
-    ifstream is(load_weights);
-    runtime_assert(is.good());
-    weights_vec w;
-    is.read((char*)&w, sizeof(w));
-    weights.from_weights(w);
+  optional<weights_vec> loaded_weights;
+  string load_weights_filename = program.get("load");
+  if(!load_weights_filename.empty()) {
+    auto file = load_weights(load_weights_filename);
+    if(file.n == 0) {
+      cerr << "loading legacy weights file, n is unknown" << endl;
+    }else if(file.n < n) {
+      cerr << "warm start from weights trained for n = " << file.n << endl;
+    }
+    loaded_weights = resize_weights(file, n);
+    weights->from_weights(*loaded_weights);
   }
 
   if(program.is_subcommand_used(train_cmd)) {
@@ -90,7 +350,10 @@ int main(int argc, char** argv) {
     u32 width = train_cmd.get<u32>("width");
     u32 count = train_cmd.get<u32>("count");
     f32 ratio = train_cmd.get<f32>("ratio");
+    u32 threads = train_cmd.get<u32>("threads");
+    u64 mem_budget = (u64)train_cmd.get<u32>("mem-budget") << 20;
 
+    string samples = train_cmd.get("samples");
     string output = train_cmd.get("output");
     
     auto config = training_config {
@@ -98,12 +361,88 @@ int main(int argc, char** argv) {
       .print = print,
       .gather_width = width,
       .gather_count = count,
+      .gather_threads = threads,
+      .mem_budget = mem_budget,
       .features_save_probability = ratio,
+      .features_save_hard = train_cmd.get<bool>("hard"),
       .training_iters = iters,
+      .samples = samples,
       .output = output,
+      .initial_weights = loaded_weights,
     };
     
     training_loop(config);
+  } else if(program.is_subcommand_used(gather_cmd)) {
+    auto config = training_config {
+      .steps = 1,
+      .print = gather_cmd.get<bool>("print"),
+      .gather_width = gather_cmd.get<u32>("width"),
+      .gather_count = gather_cmd.get<u32>("count"),
+      .gather_threads = gather_cmd.get<u32>("threads"),
+      .mem_budget = (u64)gather_cmd.get<u32>("mem-budget") << 20,
+      .features_save_probability = gather_cmd.get<f32>("ratio"),
+      .features_save_hard = gather_cmd.get<bool>("hard"),
+      .training_iters = 0,
+      .samples = "",
+      .output = gather_cmd.get("output"),
+      .initial_weights = nullopt,
+    };
+
+    training_sample_writer writer(config.output);
+    gather_samples(config, &writer);
+  } else if(program.is_subcommand_used(sweep_cmd)) {
+    auto values = [&](string const& name) {
+      vector<f64> r;
+      for(auto const& x : sweep_cmd.get<vector<string>>(name)) r.pb(stod(x));
+      return r;
+    };
+
+    // cartesian product of the given values
+    vector<training_hyperparams> hypers = { training_hyperparams{} };
+    auto expand = [&](string const& name, auto set) {
+      vector<training_hyperparams> next;
+      for(auto const& h : hypers) for(auto x : values(name)) {
+        next.pb(h);
+        set(next.back(), x);
+      }
+      hypers = next;
+    };
+    expand("alpha", [](auto& h, f64 x) { h.alpha0 = x; });
+    expand("beta1", [](auto& h, f64 x) { h.beta1 = x; });
+    expand("beta2", [](auto& h, f64 x) { h.beta2 = x; });
+    expand("lambda", [](auto& h, f64 x) { h.lambda = x; });
+    expand("batch", [](auto& h, f64 x) { h.batch_size = x; });
+    expand("init-scale", [](auto& h, f64 x) { h.init_scale = x; });
+
+    auto config = training_config {
+      .steps = 1,
+      .print = false,
+      .gather_width = 0,
+      .gather_count = 0,
+      .gather_threads = 0,
+      .mem_budget = 0,
+      .features_save_probability = 0,
+      .training_iters = sweep_cmd.get<u32>("iters"),
+      .samples = sweep_cmd.get("samples"),
+      .output = sweep_cmd.get("output"),
+      .initial_weights = loaded_weights,
+    };
+
+    sweep_hyperparams(config, sweep_config {
+        .hypers = hypers,
+        .holdout = sweep_cmd.get<f32>("holdout"),
+        .eval_width = sweep_cmd.get<u32>("eval-width"),
+        .eval_seeds = sweep_cmd.get<u32>("eval-seeds"),
+      });
+  } else if(program.is_subcommand_used(evaluate_cmd)) {
+    evaluate_weights(evaluate_config {
+        .weights = evaluate_cmd.get<vector<string>>("weights"),
+        .width = evaluate_cmd.get<u32>("width"),
+        .num_seeds = evaluate_cmd.get<u32>("seeds"),
+        .first_seed = evaluate_cmd.get<u32>("first-seed"),
+        .threads_per_search = evaluate_cmd.get<u32>("threads"),
+        .deterministic = evaluate_cmd.get<bool>("deterministic"),
+      });
   } else if(program.is_subcommand_used(solve_cmd)) {
     u32 width = solve_cmd.get<u32>("width");
     debug(width);
@@ -111,12 +450,111 @@ int main(int argc, char** argv) {
     debug(dirs);
 
     string graph_filename = solve_cmd.get<string>("output-graph");
+    u32 seed = solve_cmd.get<u32>("seed");
+    u64 mem_budget = (u64)solve_cmd.get<u32>("mem-budget") << 20;
+    runtime_assert(width > 0 || mem_budget > 0);
+    bool deterministic = solve_cmd.get<bool>("deterministic");
+
+    vector<pair<f32, f32>> width_schedule;
+    { istringstream is(solve_cmd.get<string>("width-schedule"));
+      string point;
+      while(getline(is, point, ',')) {
+        auto colon = point.find(':');
+        runtime_assert(colon != string::npos);
+        width_schedule.eb(stof(point.substr(0, colon)), stof(point.substr(colon+1)));
+        runtime_assert(width_schedule.size() == 1 ||
+                       width_schedule.end()[-2].first < width_schedule.back().first);
+      }
+    }
     
-    auto C = load_configurations();
-    runtime_assert(C.count(n));
+    puzzle_state initial_state;
+    string input = solve_cmd.get<string>("input");
+    if(input.empty()) {
+      auto C = load_configurations();
+      runtime_assert(C.count(n));
+      initial_state = C[n];
+    }else{
+      auto states = read_states(input);
+      runtime_assert(!states.empty());
+      initial_state = states[0];
+    }
     
-    solve(C[n], width, dirs, graph_filename);
+    solve_and_save(context, initial_state, solve_options {
+        .width = width,
+        .dirs = dirs,
+        .seed = seed,
+        .deterministic = deterministic,
+        .num_threads = 0,
+        .hash_bits = mem_budget > 0 ? 0 : MAX_HASH_BITS,
+        .print = true,
+        .mem_budget = mem_budget,
+        .pin_threads = solve_cmd.get<bool>("pin"),
+        .num_solutions = solve_cmd.get<u32>("solutions"),
+        .solutions_extra_levels = solve_cmd.get<u32>("extra-levels"),
+        .width_schedule = width_schedule,
+        .time_budget = solve_cmd.get<f32>("time-budget"),
+      }, graph_filename);
     
+  } else if(program.is_subcommand_used(portfolio_cmd)) {
+    auto C = load_configurations();
+    runtime_assert(C.count(n));
+
+    // every weights file with every direction
+    vector<portfolio_entry> entries;
+    for(auto const& filename : portfolio_cmd.get<vector<string>>("weights")) {
+      for(auto dirs : portfolio_cmd.get<vector<u32>>("dirs")) {
+        entries.pb(portfolio_entry { .weights = filename, .dirs = dirs });
+      }
+    }
+
+    auto result = solve_portfolio(context, C[n], entries, solve_options {
+        .width = portfolio_cmd.get<u32>("width"),
+        .seed = portfolio_cmd.get<u32>("seed"),
+        .num_threads = portfolio_cmd.get<u32>("threads"),
+        .print = true,
+      });
+    if(result.best == -1) {
+      cerr << "no entry solved" << endl;
+      return 1;
+    }
+    auto const& best = entries[result.best];
+    cerr << "best: weights = " << (best.weights.empty() ? "-" : best.weights) << ", dirs = " << best.dirs
+         << ", length = " << result.results[result.best].solution.size() << endl;
+    save_solve_result(n, best.dirs, result.results[result.best],
+                      portfolio_cmd.get<string>("output-graph"));
+  } else if(program.is_subcommand_used(batch_cmd)) {
+    // the boards of the input, then the generated ones
+    vector<puzzle_state> inputs;
+    string input = batch_cmd.get<string>("input");
+    if(!input.empty()) inputs = read_states(input);
+    u32 dir = batch_cmd.get<u32>("dir");
+    u32 first_seed = batch_cmd.get<u32>("first-seed");
+    u64 num_states = inputs.size() + batch_cmd.get<u32>("generate");
+    runtime_assert(num_states > 0);
+    auto make_state = [&](u64 i) {
+      if(i < inputs.size()) return make_beam_state(inputs[i], dir);
+      beam_state state;
+      state.generate(first_seed + (i - inputs.size()));
+      return state;
+    };
+
+    auto config = batch_config {
+      .width = batch_cmd.get<u32>("width"),
+      .threads_per_search = batch_cmd.get<u32>("threads"),
+      .seed = batch_cmd.get<u32>("seed"),
+      .deterministic = batch_cmd.get<bool>("deterministic"),
+      .print = batch_cmd.get<bool>("print"),
+      .output = batch_cmd.get<string>("output"),
+    };
+    cerr << "batch: " << num_states << " states, width = " << config.width << endl;
+    auto result = solve_batch(config, num_states, make_state);
+    cerr
+      << "length = " << setprecision(2) << fixed << result.mean_length
+      << ", failures = " << result.failures
+      << ", instances/hour = " << setprecision(1) << result.instances_per_hour
+      << ", nodes/s = " << setprecision(0) << result.nodes_per_second
+      << ", elapsed = " << setprecision(2) << result.elapsed << "s"
+      << endl;
   }else{
     cerr << program;
   }
@@ -1,59 +1,80 @@
 #include "puzzle.hpp"
+#include <omp.h>
 
 void puzzle_data::make(i32 n_) {
   n = n_;
   size = 0;
-  from_coord.clear();
+
+  // the board wraps around: (u,v) is the same cell as (u,v) + translation[k]
+  const array<i32, 2> translation[6] = {
+    {2*n-1, n-1}, {n-1, -n}, {-n, -(2*n-1)},
+    {-(2*n-1), -(n-1)}, {-(n-1), n}, {n, 2*n-1},
+  };
+
+  i32 row_start[2*MAX_N];
+  auto row_first = [&](i32 u) { return max(0, u - (n-1)); };
+  auto inside = [&](i32 u, i32 v) {
+    return 0 <= u && u < 2*n-1 && row_first(u) <= v && v <= min(2*n-2, u + n-1);
+  };
+  auto from_coord = [&](i32 u, i32 v) -> u32 {
+    if(inside(u,v)) return row_start[u] + v - row_first(u);
+    for(auto [tu,tv] : translation) {
+      if(inside(u-tu, v-tv)) return row_start[u-tu] + v-tv - row_first(u-tu);
+    }
+    impossible();
+  };
     
   FOR(u, 2*n-1) {
     u32 ncol = 2*n-1 - abs(u-(n-1));
+    row_start[u] = size;
     FOR(icol, ncol) {
-      i32 v = icol + max(0, u - (n-1));
-
+      i32 v = icol + row_first(u);
       to_coord[size] = {u,v};
-      from_coord[{u,v}] = size;
-
-      from_coord[{u + 2*n-1, v + n-1}] = size;
-      from_coord[{u + n-1, v - n}] = size;
-      from_coord[{u - n, v - (2*n-1)}] = size;
-      from_coord[{u - (2*n-1), v - (n-1)}] = size;
-      from_coord[{u - (n-1), v + n}] = size;
-      from_coord[{u + n, v + (2*n-1)}] = size;
-
       size += 1;
     }
   }
 
-  center = from_coord[{n-1,n-1}];
+  center = from_coord(n-1,n-1);
 
   FOR(ix, size) {
     auto [u,v] = to_coord[ix];
-    FOR(d, 6) rot[ix][d] = from_coord[{u+du[d],v+dv[d]}];
+    FOR(d, 6) rot[ix][d] = from_coord(u+du[d],v+dv[d]);
   }
 
-  FOR(u, size) FOR(v, size) dist[u][v] = 999'999'999;
-  FOR(u, size) {
-    FOR(x, 6) {
-      i32 v = u;
-      FORU(dx, 0, 2*n) {
-        FOR(y, 6) if(y == (x+1)%6) {
-          i32 w = v;
-          FORU(dy, 0, 2*n) {
-
-            i32 di = dx+dy;
-
-            if(di < (i32)dist[u][w]) {
-              dist[u][w] = di;
-              dist_pair[u][w] = {max(dx,dy),min(dx,dy)};
-              dist_eval[u][w] = (dx*dx+dx*dy+dy*dy) * 3 + (dx+dy) * 7;
-            }
-              
-            w = rot[w][y];
-          }
-        }
-        v = rot[v][x];
+  // The distance only depends on the displacement between the cells. It is
+  // the shortest dx steps in direction x then dy steps in direction x+1,
+  // over the images of the target, ties broken by the smallest (x, dx, dy).
+  const i32 R = 2*n-2;
+  const i32 W = 2*R+1;
+  struct entry { i32 di, x, dx, dy; };
+  vector<entry> by_displacement(W*W);
+  FORU(p, -R, R) FORU(q, -R, R) {
+    entry best = { 999'999'999, 0, 0, 0 };
+    FOR(k, 7) {
+      i32 pp = p + (k < 6 ? translation[k][0] : 0);
+      i32 qq = q + (k < 6 ? translation[k][1] : 0);
+      FOR(x, 6) {
+        i32 y = (x+1)%6;
+        i32 det = du[x]*dv[y] - du[y]*dv[x];
+        i32 dx = (pp*dv[y] - qq*du[y]) * det;
+        i32 dy = (du[x]*qq - dv[x]*pp) * det;
+        if(dx < 0 || dy < 0 || dx > 2*n || dy > 2*n) continue;
+        entry e = { dx+dy, x, dx, dy };
+        if(mt(e.di, e.x, e.dx, e.dy) < mt(best.di, best.x, best.dx, best.dy)) best = e;
       }
     }
+    by_displacement[(p+R)*W + (q+R)] = best;
+  }
+
+#pragma omp parallel for schedule(static)
+  FOR(a, size) {
+    FOR(b, size) {
+      auto const& e = by_displacement
+        [(to_coord[b][0]-to_coord[a][0]+R)*W + (to_coord[b][1]-to_coord[a][1]+R)];
+      dist[a][b] = e.di;
+      dist_pair[a][b] = {max(e.dx,e.dy),min(e.dx,e.dy)};
+      dist_eval[a][b] = (e.dx*e.dx+e.dx*e.dy+e.dy*e.dy) * 3 + (e.dx+e.dy) * 7;
+    }
   }
  
   FOR(i, size) {
@@ -65,23 +86,23 @@ void puzzle_data::make(i32 n_) {
 }
 
 void puzzle_state::set_tgt() {
-  FOR(i, puzzle.size) {
-    tok_to_pos[i] = puzzle.tgt_tok_to_pos[i];
-    pos_to_tok[i] = puzzle.tgt_pos_to_tok[i];
+  FOR(i, puzzle->size) {
+    tok_to_pos[i] = puzzle->tgt_tok_to_pos[i];
+    pos_to_tok[i] = puzzle->tgt_pos_to_tok[i];
   }
 }
 
 void puzzle_state::print() const {
-  i32 sz = 1+log10(puzzle.size);
+  i32 sz = 1+log10(puzzle->size);
   string spaces = "";
   FOR(i, sz) spaces += ' ';
   
   i32 ix = 0;
-  FOR(u, 2*puzzle.n-1) {
-    u32 ncol = 2*puzzle.n-1 - abs(u-(puzzle.n-1));
-    FOR(i, abs(u-(puzzle.n-1))) cerr << spaces;
+  FOR(u, 2*puzzle->n-1) {
+    u32 ncol = 2*puzzle->n-1 - abs(u-(puzzle->n-1));
+    FOR(i, abs(u-(puzzle->n-1))) cerr << spaces;
     FOR(icol, ncol) {
-      if(pos_to_tok[ix] == (u32)puzzle.tgt_pos_to_tok[ix]) {
+      if(pos_to_tok[ix] == (u32)puzzle->tgt_pos_to_tok[ix]) {
         cout << "\033[1;32m" << setw(sz) << pos_to_tok[ix] << "\033[0m" << spaces;
       }else{
         cerr << setw(sz) << pos_to_tok[ix] << spaces;
@@ -94,8 +115,8 @@ void puzzle_state::print() const {
 
 bool puzzle_state::get_parity() const {
   bool parity = 0;
-  vector<u32> vis(puzzle.size, 0);
-  FOR(i, puzzle.size) if(!vis[i]) {
+  vector<u32> vis(puzzle->size, 0);
+  FOR(i, puzzle->size) if(!vis[i]) {
     u32 sz = 0;
     for(u32 j = i; !vis[j]; j = pos_to_tok[j]) {
       vis[j] = 1;
@@ -113,22 +134,21 @@ void puzzle_state::generate(u64 seed) {
   u32 goal_parity = get_parity();
   
   while(1) {
-    FOR(i, puzzle.size) pos_to_tok[i] = i;
-    rng.shuffle(pos_to_tok, pos_to_tok + puzzle.size);
-    FOR(i, puzzle.size) tok_to_pos[pos_to_tok[i]] = i;
+    FOR(i, puzzle->size) pos_to_tok[i] = i;
+    rng.shuffle(pos_to_tok, pos_to_tok + puzzle->size);
+    FOR(i, puzzle->size) tok_to_pos[pos_to_tok[i]] = i;
 
     u32 parity = get_parity();
     if(parity == goal_parity) break;
   }
 }
 
-map<i32, puzzle_state> load_configurations(){
-  map<i32, puzzle_state> C; 
-  
-  ifstream is("StartingConfigurations.txt");
-  runtime_assert(is.good());
-  FORU(n, 3, 27) {
-    { i32 n_; is >> n_; runtime_assert(n == n_); }
+vector<tuple<i32, puzzle_state>> read_configurations(istream& is) {
+  vector<tuple<i32, puzzle_state>> states;
+
+  i32 n;
+  while(is >> n) {
+    runtime_assert(3 <= n && n <= MAX_N);
 
     i32 size = 0;
     FOR(u, 2*n-1) {
@@ -137,15 +157,32 @@ map<i32, puzzle_state> load_configurations(){
     }
 
     puzzle_state S0;
+    vector<bool> seen(size, false);
     FOR(i, size) {
-      is >> S0.pos_to_tok[i];
-    }
-    FOR(i, size) {
-      S0.tok_to_pos[S0.pos_to_tok[i]] = i;
+      u32 tok;
+      runtime_assert(is >> tok);
+      runtime_assert(tok < (u32)size && !seen[tok]);
+      seen[tok] = true;
+      S0.pos_to_tok[i] = tok;
+      S0.tok_to_pos[tok] = i;
     }
 
+    states.eb(n, S0);
+  }
+  runtime_assert(is.eof());
+
+  return states;
+}
+
+map<i32, puzzle_state> load_configurations(){
+  map<i32, puzzle_state> C; 
+  
+  ifstream is("StartingConfigurations.txt");
+  runtime_assert(is.good());
+  for(auto const& [n, S0] : read_configurations(is)) {
     C[n] = S0;
   }
+  FORU(n, 3, 27) runtime_assert(C.count(n));
 
   return C;
 }
@@ -4,6 +4,7 @@
 const i32 du[6] = {0,1,1,0,-1,-1};
 const i32 dv[6] = {1,1,0,-1,-1,0};
 
+const i32 MAX_N = 27;
 const u32 MAX_SIZE = 2107;
 const u32 MAX_SOLUTION_SIZE = 50'000;
 
@@ -18,7 +19,6 @@ struct puzzle_data {
   u32 dist_eval[MAX_SIZE][MAX_SIZE];
   
   array<i32, 2> to_coord[MAX_SIZE];
-  map<array<i32, 2>, u32> from_coord;
 
   i32 tgt_tok_to_pos[MAX_SIZE];
   i32 tgt_pos_to_tok[MAX_SIZE];
@@ -26,7 +26,8 @@ struct puzzle_data {
   void make(i32 n);
 };
 
-inline puzzle_data puzzle;
+// Tables of the solver context bound to the current thread (see solver_context).
+inline constinit thread_local puzzle_data* puzzle = nullptr;
 
 struct puzzle_state {
   u32 pos_to_tok[MAX_SIZE];
@@ -42,11 +43,11 @@ struct puzzle_state {
     u32 a = tok_to_pos[0], b, c;
     
     if(direction == 0) {
-      b = puzzle.rot[a][move];
-      c = puzzle.rot[a][(move+1)%6];
+      b = puzzle->rot[a][move];
+      c = puzzle->rot[a][(move+1)%6];
     }else{
-      b = puzzle.rot[a][move];
-      c = puzzle.rot[a][(move+5)%6];
+      b = puzzle->rot[a][move];
+      c = puzzle->rot[a][(move+5)%6];
     }
 
     u32 xb = pos_to_tok[b];
@@ -65,6 +66,11 @@ struct puzzle_state {
   void generate(u64 seed);
 };
    
+// Reads states in the format of StartingConfigurations.txt, the board size
+// followed by the tokens by position, until the end of the stream.
+vector<tuple<i32, puzzle_state>> read_configurations(istream& is);
+
+// The starting configurations of StartingConfigurations.txt, by board size.
 map<i32, puzzle_state> load_configurations();
 
 
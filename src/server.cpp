@@ -0,0 +1,191 @@
+#include "server.hpp"
+#include "solver.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The modification time and size of a weights file, to notice that it was
+// rewritten under the same name.
+using weights_stamp = tuple<filesystem::file_time_type, u64>;
+
+weights_stamp stamp_of(string const& filename) {
+  return mt(filesystem::last_write_time(filename), (u64) filesystem::file_size(filename));
+}
+
+struct server_state {
+  struct entry {
+    unique_ptr<solver_context> context;
+    string weights_filename;
+    weights_stamp stamp;
+    u64 last_used;
+  };
+  server_config config;
+  map<i32, entry> entries;
+  map<i32, puzzle_state> configurations;
+  u64 num_jobs = 0;
+
+  solver_context& context(i32 n, string const& weights_filename) {
+    num_jobs += 1;
+    if(!entries.count(n) && config.max_contexts > 0 && entries.size() >= config.max_contexts) {
+      // the least recently used board size makes room
+      auto lru = min_element(all(entries), [&](auto const& a, auto const& b) {
+        return a.second.last_used < b.second.last_used;
+      });
+      entries.erase(lru);
+    }
+
+    auto &e = entries[n];
+    e.last_used = num_jobs;
+    bool fresh = !e.context;
+    if(fresh) {
+      e.context = make_unique<solver_context>(n);
+    }
+    if(weights_filename.empty()) {
+      if(!fresh && !e.weights_filename.empty()) {
+        solver_tables_guard guard(e.context->tables());
+        weights->init();
+      }
+      e.weights_filename = "";
+    }else{
+      auto stamp = stamp_of(weights_filename);
+      if(fresh || e.weights_filename != weights_filename || e.stamp != stamp) {
+        e.context->set_weights(load_weights(weights_filename));
+        e.weights_filename = weights_filename;
+        e.stamp = stamp;
+      }
+    }
+    return *e.context;
+  }
+
+  string run(string const& line);
+};
+
+string server_state::run(string const& line) {
+  map<string, string> fields;
+  { istringstream is(line);
+    string token;
+    while(is >> token) {
+      auto eq = token.find('=');
+      if(eq == string::npos) fields[token] = "";
+      else fields[token.substr(0, eq)] = token.substr(eq+1);
+    }
+  }
+  string id = fields.count("id") ? fields["id"] : "";
+
+  try {
+    if(!fields.count("n")) throw runtime_error("missing n");
+    if(!fields.count("width")) throw runtime_error("missing width");
+    i32 n = stoi(fields["n"]);
+    runtime_assert(3 <= n && n <= 27);
+
+    auto &context = this->context(n, fields.count("weights") ? fields["weights"] : "");
+    solver_tables_guard guard(context.tables());
+
+    puzzle_state initial_state;
+    if(fields.count("state")) {
+      istringstream is(fields["state"]);
+      string tok;
+      u32 size = 0;
+      while(getline(is, tok, ',')) {
+        runtime_assert(size < puzzle->size);
+        initial_state.pos_to_tok[size++] = stoul(tok);
+      }
+      runtime_assert(size == puzzle->size);
+      vector<bool> seen(puzzle->size, false);
+      FOR(i, size) {
+        runtime_assert(initial_state.pos_to_tok[i] < puzzle->size && !seen[initial_state.pos_to_tok[i]]);
+        seen[initial_state.pos_to_tok[i]] = true;
+        initial_state.tok_to_pos[initial_state.pos_to_tok[i]] = i;
+      }
+    }else if(fields.count("generate")) {
+      initial_state.generate(stoull(fields["generate"]));
+    }else if(fields.count("initial")) {
+      if(configurations.empty()) configurations = load_configurations();
+      initial_state = configurations[n];
+    }else{
+      throw runtime_error("missing state");
+    }
+
+    auto get = [&](string const& key, u64 def) {
+      return fields.count(key) ? stoull(fields[key]) : def;
+    };
+    auto result = context.solve(initial_state, solve_options {
+        .width = get("width", 0),
+        .dirs = (u32) get("dirs", 0),
+        .seed = get("seed", 0),
+        .deterministic = get("deterministic", 0) != 0,
+        .num_threads = (u32) get("threads", 0),
+        .hash_bits = 0,
+        .print = false,
+      });
+
+    ostringstream os;
+    os << "id=" << id;
+    if(result.solution.empty()) {
+      os << " error no solution found";
+    }else{
+      os << " ok length=" << result.solution.size()
+         << " nodes=" << result.num_nodes
+         << " elapsed=" << setprecision(3) << fixed << result.elapsed
+         << " solution=" << n << ":" << result.moves;
+    }
+    return os.str();
+  } catch(exception const& err) {
+    return "id=" + id + " error " + err.what();
+  }
+}
+
+void serve(server_config const& config) {
+  server_state state;
+  state.config = config;
+
+  if(config.socket_path.empty()) {
+    string line;
+    while(getline(cin, line)) {
+      if(line.empty()) continue;
+      cout << state.run(line) << endl;
+    }
+    return;
+  }
+
+  i32 fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  runtime_assert(fd >= 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  runtime_assert(config.socket_path.size() < sizeof(addr.sun_path));
+  strcpy(addr.sun_path, config.socket_path.c_str());
+  unlink(config.socket_path.c_str());
+  runtime_assert(bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0);
+  runtime_assert(listen(fd, 16) == 0);
+  cerr << "listening on " << config.socket_path << endl;
+
+  // one connection at a time, each job uses all the threads
+  while(1) {
+    i32 conn = accept(fd, nullptr, nullptr);
+    if(conn < 0) continue;
+
+    string buffer;
+    char data[4096];
+    bool open = true;
+    while(open) {
+      i64 count = read(conn, data, sizeof(data));
+      if(count <= 0) break;
+      buffer.append(data, count);
+      u64 eol;
+      while(open && (eol = buffer.find('\n')) != string::npos) {
+        string line = buffer.substr(0, eol);
+        buffer.erase(0, eol+1);
+        if(line.empty()) continue;
+        string response = state.run(line) + "\n";
+        u64 written = 0;
+        while(written < response.size()) {
+          i64 w = send(conn, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+          if(w <= 0) { open = false; break; }
+          written += w;
+        }
+      }
+    }
+    close(conn);
+  }
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "header.hpp"
+
+// Batch solve server. Jobs are read one per line, as space separated
+// key=value fields:
+//   id=<string>          echoed in the response
+//   n=<3..27>            board size
+//   width=<u64>          beam width
+//   state=<t0,t1,...>    tokens by position, or
+//   generate=<seed>      a random state, or
+//   initial              the starting configuration for n
+//   weights=<file>       optional, the default evaluation otherwise
+//   dirs, seed, threads, deterministic=<0|1>   optional, as in solve
+// Each job gets one response line:
+//   id=<id> ok length=<L> nodes=<N> elapsed=<s> solution=<n>:<moves>
+//   id=<id> error <message>
+// The tables of each board size, the weights and the hash tables are kept
+// between jobs, for at most max_contexts board sizes. A weights file is
+// loaded again when it was rewritten since the last job that named it.
+struct server_config {
+  string socket_path; // empty to read jobs from stdin and answer on stdout
+  u32 max_contexts = 4; // board sizes kept, the least recently used goes first, 0 for no limit
+};
+
+void serve(server_config const& config);
@@ -2,7 +2,7 @@
 #include "beam_search.hpp"
 #include <omp.h>
 
-void save_solution
+string solution_moves
 (u32 initial_directions,
  vector<u8> const& solution)
 {
@@ -33,49 +33,314 @@ void save_solution
 
   reverse(all(R));
   L.insert(end(L),all(R));
-
-  auto cost = L.size();
-  auto filename = "solutions/" + to_string(puzzle.n) + "/" + to_string(cost); 
-  
-  ofstream out(filename);
-  out << puzzle.n << ":";
-  for(auto c : L) {
-    out << c;
-  }
-  out << endl;
-  out.close();
+  return string(all(L));
 }
 
-void solve
-(puzzle_state const& initial_state,
- u32 width,
- u32 dirs,
- string const& graph_filename) {
-
-  auto search = make_unique<beam_search>(beam_search_config {
-      .print = true,
-      .print_interval = 1,
-      .width = width,
-      .features_save_probability = 0.0,
-      .num_threads = (u32)omp_get_max_threads()
-    });
-
+beam_state make_beam_state(puzzle_state const& initial_state, u32 dirs) {
   beam_state state;
   state.src = initial_state;
   state.src.direction = (dirs >> 0) & 1;
   state.tgt.set_tgt();
   state.tgt.direction = (dirs >> 1) & 1;
   state.init();
+  return state;
+}
+
+solver_context::solver_context(i32 n)
+  // the tables are only written up to the board size, leave the rest untouched
+  : puzzle(make_unique_for_overwrite<puzzle_data>()),
+    feature_keys(make_unique_for_overwrite<feature_keys_t>()),
+    weights(make_unique_for_overwrite<weights_t>()),
+    tree_pool(make_unique<tree_pool_t>())
+{
+  solver_tables_guard guard(tables());
+  puzzle->make(n);
+  init_eval();
+}
+
+solver_context::~solver_context() {
+}
+
+unique_ptr<solver_context> solver_context::sharing_tables(solver_context const& other) {
+  auto context = unique_ptr<solver_context>(new solver_context());
+  context->puzzle = other.puzzle;
+  context->feature_keys = other.feature_keys;
+  context->weights = make_unique<weights_t>(*other.weights);
+  context->tree_pool = make_unique<tree_pool_t>();
+  return context;
+}
+
+solver_tables solver_context::tables() const {
+  return solver_tables {
+    .puzzle = puzzle.get(),
+    .feature_keys = feature_keys.get(),
+    .weights = weights.get(),
+    .tree_pool = tree_pool.get(),
+  };
+}
+
+u64 solver_context::memory() const {
+  return sizeof(puzzle_data) + sizeof(feature_keys_t) + sizeof(weights_t);
+}
+
+void solver_context::set_weights(weights_vec const& w) {
+  solver_tables_guard guard(tables());
+  weights->from_weights(w);
+}
+
+void solver_context::set_weights(weights_file const& file) {
+  // resizing reads the feature keys of the board size
+  solver_tables_guard guard(tables());
+  weights->from_weights(resize_weights(file, puzzle->n));
+}
+
+solve_result solver_context::solve
+(puzzle_state const& initial_state,
+ solve_options const& options)
+{
+  timer timer_setup;
+  solver_tables_guard guard(tables());
   
+  beam_state state = make_beam_state(initial_state, options.dirs);
+  u32 max_heur = beam_search_max_heur(state);
+
+  auto config = beam_search_config {
+    .print = options.print,
+    .print_interval = 1,
+    .width = options.width,
+    .features_save_probability = 0.0,
+    .features_save_hard = false,
+    .seed = options.seed,
+    .num_threads = options.num_threads > 0 ? options.num_threads : (u32)omp_get_max_threads(),
+    .hash_bits = options.hash_bits > 0 ? options.hash_bits : hash_bits_for_width(options.width),
+    .deterministic = options.deterministic,
+    .pin_threads = options.pin_threads,
+    .num_solutions = options.num_solutions,
+    .solutions_extra_levels = options.solutions_extra_levels,
+    .width_schedule = options.width_schedule,
+    .max_solution_length = options.max_solution_length,
+    .time_budget = options.time_budget,
+  };
+  if(options.mem_budget > 0) {
+    u64 context_memory = memory();
+    if(options.mem_budget <= context_memory) throw runtime_error("memory budget too small for the tables");
+    config = plan_beam_search(config, options.mem_budget - context_memory, max_heur);
+    if(options.print) {
+      cerr << "plan: width = " << config.width
+           << ", hash table = " << (sizeof(u64) << config.hash_bits) / (1<<20) << "MB"
+           << ", estimated memory = "
+           << (context_memory + beam_search_memory(config, max_heur)) / (1<<20) << "MB"
+           << endl;
+    }
+  }
+  if(!search || search->config.num_threads != config.num_threads ||
+     search->config.hash_bits != config.hash_bits ||
+     search->config.pin_threads != config.pin_threads) {
+    search.reset();
+    search = make_unique<beam_search>(config);
+  }else{
+    search->config = config;
+    search->should_stop = false;
+  }
+
+  if(options.time_budget > 0) {
+    // making the search fills its hash table, which can take seconds
+    search->config.time_budget = max(1e-3, options.time_budget - timer_setup.elapsed());
+  }
+
+  timer timer_solve;
   auto result = search->search(state);
-  save_solution(dirs, result.solution);
+
+  vector<string> all_moves;
+  for(auto const& solution : result.solutions) {
+    all_moves.pb(solution_moves(options.dirs, solution));
+  }
+
+  return solve_result {
+    .solution = result.solution,
+    .moves = solution_moves(options.dirs, result.solution),
+    .all_moves = all_moves,
+    .graph = result.graph,
+    .num_nodes = result.num_nodes,
+    .elapsed = timer_solve.elapsed(),
+    .stopped = result.stopped,
+  };
+}
+
+void save_solve_result
+(i32 n,
+ u32 dirs,
+ solve_result const& result,
+ string const& graph_filename) {
+
+  auto filename = "solutions/" + to_string(n) + "/" + to_string(result.moves.size()); 
+  ofstream out(filename);
+  out << n << ":" << result.moves << endl;
+  out.close();
+
+  if(result.all_moves.size() > 1) {
+    ofstream out(filename + ".top");
+    for(auto const& moves : result.all_moves) {
+      out << moves.size() << " " << dirs << " " << n << ":" << moves << endl;
+    }
+  }
+
   if(!graph_filename.empty()) {
     ofstream os(graph_filename);
     for(auto p : result.graph) {
-      os << p.step << ' ' << p.min_cost << ' ' << p.avg_cost << endl;
+      os << p.step << ' ' << p.min_cost << ' ' << p.avg_cost << ' ' << p.width << endl;
     }
     os.flush();
     os.close();
   }
 }
 
+void solve_and_save
+(solver_context& context,
+ puzzle_state const& initial_state,
+ solve_options const& options,
+ string const& graph_filename) {
+
+  auto result = context.solve(initial_state, options);
+  save_solve_result(context.puzzle->n, options.dirs, result, graph_filename);
+}
+
+portfolio_result solve_portfolio
+(solver_context const& context,
+ puzzle_state const& initial_state,
+ vector<portfolio_entry> const& entries,
+ solve_options const& options)
+{
+  runtime_assert(!entries.empty());
+  u32 max_threads = options.num_threads > 0 ? options.num_threads : (u32)omp_get_max_threads();
+  u32 num_workers = min<u32>(entries.size(), max_threads);
+  u32 threads_per_search = max(1u, max_threads / num_workers);
+
+  // the entries only need their own weights, tours and search, as a context
+  // runs one solve at a time
+  vector<unique_ptr<solver_context>> contexts(entries.size());
+  FOR(i, entries.size()) {
+    contexts[i] = solver_context::sharing_tables(context);
+    if(!entries[i].weights.empty()) {
+      contexts[i]->set_weights(load_weights(entries[i].weights));
+    }
+  }
+
+  atomic<u32> best_length = numeric_limits<u32>::max();
+  portfolio_result result;
+  result.results.resize(entries.size());
+  omp_set_max_active_levels(2);
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_workers)
+  FOR(i, entries.size()) {
+    auto entry_options = options;
+    entry_options.dirs = entries[i].dirs;
+    entry_options.num_threads = threads_per_search;
+    entry_options.print = false;
+    entry_options.max_solution_length = &best_length;
+    auto entry_result = contexts[i]->solve(initial_state, entry_options);
+
+    u32 length = entry_result.solution.size();
+    if(length > 0) {
+      u32 prev = best_length.load(memory_order_relaxed);
+      while(length < prev && !best_length.compare_exchange_weak(prev, length)) { }
+    }
+    if(options.print) {
+#pragma omp critical
+      { cerr << "portfolio: weights = " << (entries[i].weights.empty() ? "-" : entries[i].weights)
+             << ", dirs = " << entries[i].dirs;
+        if(length > 0) cerr << ", length = " << length;
+        else if(entry_result.stopped) cerr << ", stopped";
+        else cerr << ", failed";
+        cerr << ", elapsed = " << setprecision(2) << fixed << entry_result.elapsed << "s" << endl;
+      }
+    }
+    result.results[i] = entry_result;
+  }
+
+  FOR(i, entries.size()) {
+    auto const& solution = result.results[i].solution;
+    if(solution.empty()) continue;
+    if(result.best == -1 || solution.size() < result.results[result.best].solution.size()) {
+      result.best = i;
+    }
+  }
+  return result;
+}
+
+batch_result solve_batch
+(batch_config const& config,
+ u64 num_states,
+ function<beam_state(u64)> const& make_state)
+{
+  i32 max_threads = omp_get_max_threads();
+  u32 threads_per_search = config.threads_per_search;
+  if(threads_per_search == 0) {
+    threads_per_search = clamp<i64>(config.width / (1<<16), 1, max_threads);
+  }
+  i32 num_searches = max(1, max_threads / (i32)threads_per_search);
+  num_searches = max<i64>(1, min<i64>(num_searches, num_states));
+
+  auto search_config = beam_search_config {
+    .print = false,
+    .print_interval = 1,
+    .width = config.width,
+    .features_save_probability = 0.0,
+    .features_save_hard = false,
+    .seed = config.seed,
+    .num_threads = threads_per_search,
+    .hash_bits = hash_bits_for_width(config.width),
+    .deterministic = config.deterministic,
+  };
+
+  vector<unique_ptr<beam_search>> searches(num_searches);
+  FOR(i, num_searches) searches[i] = make_unique<beam_search>(search_config);
+  omp_set_max_active_levels(2);
+
+  optional<ofstream> out;
+  if(!config.output.empty()) out.emplace(config.output);
+
+  batch_result result;
+  result.solutions.resize(num_states);
+  u64 num_nodes = 0;
+  timer timer_batch;
+
+  auto tables = solver_tables::current();
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_searches) reduction(+:num_nodes)
+  FOR(i, num_states) {
+    tables.bind();
+    beam_search &search = *searches[omp_get_thread_num()];
+    beam_state state = make_state(i);
+    auto search_result = search.search(state);
+    result.solutions[i] = search_result.solution;
+    num_nodes += search_result.num_nodes;
+
+    u32 dirs = state.src.direction | (state.tgt.direction << 1);
+#pragma omp critical
+    {
+      if(config.print) {
+        cerr << "instance " << i << ": ";
+        if(search_result.solution.empty()) cerr << "failed";
+        else cerr << "length = " << search_result.solution.size();
+        cerr << ", elapsed = " << setprecision(2) << fixed << timer_batch.elapsed() << "s" << endl;
+      }
+      if(out && !search_result.solution.empty()) {
+        *out << i << " " << search_result.solution.size() << " " << dirs << " "
+             << puzzle->n << ":" << solution_moves(dirs, search_result.solution) << endl;
+      }
+    }
+  }
+
+  result.elapsed = timer_batch.elapsed();
+  f64 total = 0;
+  u32 count = 0;
+  for(auto const& solution : result.solutions) if(!solution.empty()) {
+    total += solution.size();
+    count += 1;
+  }
+  result.failures = num_states - count;
+  result.mean_length = total / max(1u, count);
+  result.instances_per_hour = num_states * 3600.0 / result.elapsed;
+  result.nodes_per_second = num_nodes / result.elapsed;
+  return result;
+}
@@ -1,9 +1,136 @@
 #pragma once
 #include "header.hpp"
 #include "puzzle.hpp"
+#include "eval.hpp"
+#include "beam_search.hpp"
 
-void solve
-(puzzle_state const& initial_state,
- u32 width,
+struct solve_options {
+  u64  width;
+  u32  dirs = 0; // initial direction of the source (bit 0) and of the target (bit 1)
+  u64  seed = 0;
+  bool deterministic = false;
+  u32  num_threads = 0; // 0 for omp_get_max_threads()
+  u32  hash_bits = 0;   // 0 to size the hash table from the width
+  bool print = false;
+  // bytes for the whole solve including the context, 0 for no limit. The
+  // width (at most width if it is set) and the hash table are picked to fit.
+  u64  mem_budget = 0;
+  bool pin_threads = false;
+  // keep up to num_solutions, from the first solved level and the next
+  // solutions_extra_levels ones
+  u32  num_solutions = 1;
+  u32  solutions_extra_levels = 0;
+  vector<pair<f32, f32>> width_schedule = {}; // see beam_search_config
+  atomic<u32> const* max_solution_length = nullptr; // see beam_search_config
+  f64  time_budget = 0; // seconds, the width is then at most width
+};
+
+struct solve_result {
+  vector<u8> solution; // empty if the search failed
+  string moves;        // the solution in the submission format
+  vector<string> all_moves; // every kept solution, shortest first, starting with moves
+  vector<beam_search_result_entry> graph;
+  u64 num_nodes;
+  f64 elapsed;
+  bool stopped; // by options.max_solution_length, before a solution was found
+};
+
+// Owns everything a solve needs for one board size: the puzzle and feature
+// tables, the weights, the tour pool and the hash table of the last search.
+// Contexts are independent and can solve concurrently from different
+// threads, but a context runs one solve at a time.
+struct solver_context {
+  shared_ptr<puzzle_data> puzzle; // only read by the solves, shared by sharing_tables
+  shared_ptr<feature_keys_t> feature_keys;
+  unique_ptr<weights_t> weights;
+  unique_ptr<tree_pool_t> tree_pool;
+  unique_ptr<beam_search> search; // reused while the threads and hash size are unchanged
+
+  explicit solver_context(i32 n);
+  ~solver_context();
+
+  solver_context(solver_context const& other) = delete;
+
+  // A context on the puzzle and feature tables of other, with a copy of its
+  // weights, and its own tour pool and search.
+  static unique_ptr<solver_context> sharing_tables(solver_context const& other);
+
+  solver_tables tables() const;
+  void set_weights(weights_vec const& w);
+  void set_weights(weights_file const& file); // resized to the board size
+  u64 memory() const; // of the tables, without the search
+
+  solve_result solve(puzzle_state const& initial_state, solve_options const& options);
+
+private:
+  solver_context() = default;
+};
+
+string solution_moves(u32 initial_directions, vector<u8> const& solution);
+
+// The search state for a board, with the given initial directions, on the
+// current tables.
+beam_state make_beam_state(puzzle_state const& initial_state, u32 dirs);
+
+// Writes the solution to solutions/<n>/<length>. With several solutions,
+// they are also listed in solutions/<n>/<length>.top, one per line as
+// "<length> <dirs> <n>:<moves>".
+void save_solve_result
+(i32 n,
  u32 dirs,
+ solve_result const& result,
+ string const& graph_filename);
+
+// Solves with the context, and saves the result.
+void solve_and_save
+(solver_context& context,
+ puzzle_state const& initial_state,
+ solve_options const& options,
  string const& graph_filename);
+
+struct portfolio_entry {
+  string weights; // weights file, empty for the weights of the context
+  u32 dirs;
+};
+
+struct portfolio_result {
+  vector<solve_result> results; // of each entry, without a solution if it failed or was stopped
+  i32 best = -1; // entry with the shortest solution
+};
+
+// Solves the same state with every entry concurrently, each with its own
+// weights, tours and search on the tables of context, and a share of
+// options.num_threads. A search stops as soon as its next level could not be
+// shorter than the best solution found so far.
+portfolio_result solve_portfolio
+(solver_context const& context,
+ puzzle_state const& initial_state,
+ vector<portfolio_entry> const& entries,
+ solve_options const& options);
+
+struct batch_config {
+  u64  width;
+  u32  threads_per_search; // 0 to pick from the width
+  u64  seed = 0;
+  bool deterministic = false;
+  bool print = false; // a line per instance
+  string output; // solutions as "<index> <length> <dirs> <n>:<moves>" lines, empty for none
+};
+
+struct batch_result {
+  vector<vector<u8>> solutions; // of each state, empty if the search failed
+  u32 failures;
+  f64 mean_length;
+  f64 instances_per_hour;
+  f64 nodes_per_second;
+  f64 elapsed;
+};
+
+// Solves num_states states on the current tables, running several searches
+// at once with a share of the threads each. The state of index i is made by
+// make_state(i) when its search starts, so that only the running ones are
+// held in memory.
+batch_result solve_batch
+(batch_config const& config,
+ u64 num_states,
+ function<beam_state(u64)> const& make_state);
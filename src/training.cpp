@@ -1,16 +1,162 @@
 #include "training.hpp"
 #include "beam_search.hpp"
 #include "eval.hpp"
+#include "evaluate.hpp"
 #include <omp.h>
-
-const i32 BATCH_SIZE = 1<<16;
+#include <unistd.h>
 
 f64 sigmoid(f64 z) {
   return 1.0 / (1.0 + std::exp(-z));
 }
 
-vector<training_sample> gather_samples(training_config const& config) {
-  vector<training_sample> samples;
+void training_sample_store::add(features_vec const& v1, features_vec const& v2) {
+  FOR(i, NUM_FEATURES) if(v1[i] != v2[i]) {
+    keys.pb(i);
+    values.pb(v1[i] - v2[i]);
+  }
+  offsets.pb(keys.size());
+}
+
+void training_sample_store::add(training_sample_store const& other, u64 isample) {
+  keys.insert(end(keys),
+              begin(other.keys) + other.offsets[isample],
+              begin(other.keys) + other.offsets[isample+1]);
+  values.insert(end(values),
+                begin(other.values) + other.offsets[isample],
+                begin(other.values) + other.offsets[isample+1]);
+  offsets.pb(keys.size());
+}
+
+void training_sample_store::append(training_sample_store const& other) {
+  u64 base = keys.size();
+  keys.insert(end(keys), all(other.keys));
+  values.insert(end(values), all(other.values));
+  FORU(i, 1, other.size()) offsets.pb(base + other.offsets[i]);
+}
+
+void training_sample_store::clear() {
+  offsets.assign(1, 0);
+  keys.clear();
+  values.clear();
+}
+
+u64 training_sample_store::memory_bytes() const {
+  return
+    offsets.capacity() * sizeof(u64) +
+    keys.capacity() * sizeof(u8) +
+    values.capacity() * sizeof(i16);
+}
+
+const char SAMPLES_MAGIC[8] = {'B','A','L','T','S','M','P','1'};
+
+training_sample_writer::training_sample_writer(string const& filename)
+  : os(filename, ios::binary)
+{
+  runtime_assert(os.good());
+  i32 n = puzzle->n;
+  u32 num_features = NUM_FEATURES;
+  os.write(SAMPLES_MAGIC, sizeof(SAMPLES_MAGIC));
+  os.write((char*)&n, sizeof(n));
+  os.write((char*)&num_features, sizeof(num_features));
+  num_bytes = sizeof(SAMPLES_MAGIC) + sizeof(n) + sizeof(num_features);
+}
+
+void training_sample_writer::write(training_sample_store const& chunk) {
+  u32 num_chunk_samples = chunk.size();
+  u64 num_entries = chunk.keys.size();
+  if(num_chunk_samples == 0) return;
+
+  vector<u8> sizes(num_chunk_samples);
+  FOR(i, num_chunk_samples) sizes[i] = chunk.offsets[i+1] - chunk.offsets[i];
+
+  os.write((char*)&num_chunk_samples, sizeof(num_chunk_samples));
+  os.write((char*)&num_entries, sizeof(num_entries));
+  os.write((char*)sizes.data(), num_chunk_samples * sizeof(u8));
+  os.write((char*)chunk.keys.data(), num_entries * sizeof(u8));
+  os.write((char*)chunk.values.data(), num_entries * sizeof(i16));
+  os.flush();
+  runtime_assert(os.good());
+
+  num_samples += num_chunk_samples;
+  num_bytes +=
+    sizeof(num_chunk_samples) + sizeof(num_entries) +
+    num_chunk_samples * sizeof(u8) +
+    num_entries * (sizeof(u8) + sizeof(i16));
+}
+
+void load_samples(string const& filename, training_sample_store& samples) {
+  timer timer_load;
+  ifstream is(filename, ios::binary);
+  runtime_assert(is.good());
+  is.seekg(0, ios::end);
+  u64 file_size = is.tellg();
+  is.seekg(0, ios::beg);
+
+  char magic[8];
+  i32 n;
+  u32 num_features;
+  is.read(magic, sizeof(magic));
+  is.read((char*)&n, sizeof(n));
+  is.read((char*)&num_features, sizeof(num_features));
+  runtime_assert(is.good());
+  runtime_assert(equal(magic, magic + 8, SAMPLES_MAGIC));
+  runtime_assert(n == puzzle->n);
+  runtime_assert(num_features == NUM_FEATURES);
+
+  u64 num_bytes = 0;
+  vector<u8> sizes;
+  while(1) {
+    u32 num_chunk_samples;
+    u64 num_entries;
+    if(is.peek() == ifstream::traits_type::eof()) break;
+    is.read((char*)&num_chunk_samples, sizeof(num_chunk_samples));
+    is.read((char*)&num_entries, sizeof(num_entries));
+    runtime_assert(is.good());
+
+    // a corrupt header must not make us allocate more than the file holds
+    u64 remaining = file_size - (u64) is.tellg();
+    runtime_assert(num_chunk_samples <= remaining);
+    runtime_assert(num_entries <= (remaining - num_chunk_samples) / (sizeof(u8) + sizeof(i16)));
+
+    sizes.resize(num_chunk_samples);
+    is.read((char*)sizes.data(), num_chunk_samples * sizeof(u8));
+    runtime_assert(is.good());
+
+    u64 base = samples.keys.size();
+    samples.keys.resize(base + num_entries);
+    samples.values.resize(base + num_entries);
+    is.read((char*)(samples.keys.data() + base), num_entries * sizeof(u8));
+    is.read((char*)(samples.values.data() + base), num_entries * sizeof(i16));
+    runtime_assert(is.good());
+
+    FOR(i, num_chunk_samples) {
+      base += sizes[i];
+      samples.offsets.pb(base);
+    }
+    runtime_assert(base == samples.keys.size());
+    num_bytes += num_chunk_samples + num_entries * (sizeof(u8) + sizeof(i16));
+  }
+
+  samples.offsets.shrink_to_fit();
+  samples.keys.shrink_to_fit();
+  samples.values.shrink_to_fit();
+
+  f64 elapsed = timer_load.elapsed();
+  cerr
+    << "loaded " << samples.size() << " samples"
+    << ", " << setprecision(2) << fixed << (f64) samples.memory_bytes() / samples.size() << " bytes/sample"
+    << ", memory = " << setprecision(1) << fixed << samples.memory_bytes() / 1e6 << "MB"
+    << ", " << setprecision(1) << fixed << num_bytes / 1e6 / elapsed << "MB/s"
+    << endl;
+}
+
+training_sample_store gather_samples
+(training_config const& config,
+ training_sample_writer* writer)
+{
+  training_sample_store samples;
+  u64 num_samples = 0;
+  timer timer_gather;
 
   i64 total_count = 0;
   f64 total_size = 0;
@@ -18,29 +164,61 @@ vector<training_sample> gather_samples(training_config const& config) {
 
   i64 base_seed = rng.randomInt64();
 
-  i32 num_threads = omp_get_max_threads();
-  vector<unique_ptr<beam_search>> searches(num_threads);
+  u32 search_threads = max(1u, config.gather_threads);
+  i32 num_searches = max(1, omp_get_max_threads() / (i32)search_threads);
+
+  auto search_config = beam_search_config {
+    .print = config.print,
+    .print_interval = 1000,
+    .width = config.gather_width,
+    .features_save_probability = config.features_save_probability,
+    .features_save_hard = config.features_save_hard,
+    .seed = 0,
+    .num_threads = search_threads,
+    .hash_bits = hash_bits_for_width(config.gather_width),
+  };
+
+  // shrink the hash tables first, then run fewer searches
+  if(config.mem_budget > 0) {
+    while(search_config.hash_bits > MIN_HASH_BITS &&
+          num_searches * beam_search_memory(search_config) > config.mem_budget) {
+      search_config.hash_bits -= 1;
+    }
+    while(num_searches > 1 &&
+          num_searches * beam_search_memory(search_config) > config.mem_budget) {
+      num_searches -= 1;
+    }
+  }
+
+  cerr
+    << "gather: " << num_searches << " searches"
+    << " x " << search_threads << " threads"
+    << ", hash table = " << setprecision(1) << fixed
+    << (f64) (sizeof(u64) << search_config.hash_bits) / (1<<20) << "MB"
+    << ", estimated memory = " << setprecision(1) << fixed
+    << (f64) num_searches * beam_search_memory(search_config) / (1<<20) << "MB"
+    << endl;
 
-#pragma omp parallel
+  vector<unique_ptr<beam_search>> searches(num_searches);
+  omp_set_max_active_levels(2);
+
+  auto tables = solver_tables::current();
+#pragma omp parallel num_threads(num_searches)
   {
+    tables.bind();
     auto thread_id = omp_get_thread_num();
 
 #pragma omp critical
     {
-      searches[thread_id] = make_unique<beam_search>(beam_search_config {
-          .print = config.print,
-          .print_interval = 1000,
-          .width = config.gather_width,
-          .features_save_probability = config.features_save_probability,
-          .num_threads = 1,
-        });
+      searches[thread_id] = make_unique<beam_search>(search_config);
     }
   }
 
-  while(samples.size() < config.gather_count) {
+  while(num_samples < config.gather_count) {
     
-#pragma omp parallel
+#pragma omp parallel num_threads(num_searches)
     {
+      tables.bind();
       auto thread_id = omp_get_thread_num();
 
       beam_search &search = *searches[thread_id];
@@ -52,44 +230,35 @@ vector<training_sample> gather_samples(training_config const& config) {
         seed = base_seed;
       }
     
-      puzzle_state src;
-      src.generate(seed);
-
       beam_state state;
-      state.src = src;
-      state.src.direction = rng.random32(2);
-      state.tgt.set_tgt();
-      state.tgt.direction = rng.random32(2);
-      state.init();
+      state.generate(seed);
     
+      search.config.seed = seed;
       auto result = search.search(state);
 
-      u64 size;
-      u64 from;
+      u64 size = result.solution.size();
+      training_sample_store chunk;
+      if(size > 0) {
+        u32 ipath = 0;
+        for(auto const& [i,v] : result.saved_features) {
+          while(get<0>(result.path_features[ipath]) < i) ipath += 1;
+          chunk.add(get<1>(result.path_features[ipath]), v);
+        }
+      }
+
 #pragma omp critical
       {
-        size = result.solution.size();
-        from = samples.size();
         if(size > 0) {
           total_size += size;
           total_size2 += (f64)size * size;
           total_count += 1;
- 
-          samples.resize(from + result.saved_features.size());
-
-          if(samples.size() / 100'000 != from / 100'000) debug(samples.size());
-
-          i32 curi = 0;
-          for(auto [i,v] : result.saved_features) {
-            while(curi < i) {
-              state.do_move(result.solution[curi]);
-              curi += 1;
-            }
-            features_vec v1;
-            state.features(v1);
-            samples[from] = training_sample(v1, v);
-            from += 1;
-          }
+
+          u64 from = num_samples;
+          num_samples += chunk.size();
+          if(num_samples / 100'000 != from / 100'000) debug(num_samples);
+
+          if(writer) writer->write(chunk);
+          else samples.append(chunk);
         }
       }
     }
@@ -105,69 +274,112 @@ vector<training_sample> gather_samples(training_config const& config) {
       << "sizes = " << setprecision(6) << fixed << mean << " ± " << std
       << endl;
   }
+
+  {
+    f64 elapsed = timer_gather.elapsed();
+    f64 bytes = writer ? writer->num_bytes : samples.memory_bytes();
+    cerr
+      << "gathered " << num_samples << " samples"
+      << ", " << setprecision(1) << fixed << num_samples / elapsed << " samples/s"
+      << ", " << setprecision(2) << fixed << bytes / max<u64>(1, num_samples) << " bytes/sample"
+      << endl;
+  }
   
   return samples;
 }
 
-void update_weights(training_config const& config,
-                    vector<training_sample> const& samples)
+struct alignas(64) gradient_buffer {
+  weights_vec g;
+};
+
+// Adds the gradient of tanh(w^T X) for sample X to g, returns tanh(w^T X).
+FORCE_INLINE
+f64 sample_gradient
+(training_sample_store const& samples,
+ u64 isample,
+ weights_vec const& w,
+ weights_vec& g)
+{
+  u64 from = samples.offsets[isample], to = samples.offsets[isample+1];
+  u8  const* keys   = samples.keys.data();
+  i16 const* values = samples.values.data();
+
+  f64 value = 0.0;
+  for(u64 j = from; j < to; ++j) {
+    value += values[j] * w[keys[j]];
+  }
+  value = tanh(value);
+  f64 derivative = 1-value*value;
+
+  for(u64 j = from; j < to; ++j) {
+    g[keys[j]] += values[j] * derivative;
+  }
+
+  return value;
+}
+
+weights_vec update_weights(training_config const& config,
+                           training_sample_store const& samples)
 {
   weights_vec w;
-  FOR(i, NUM_FEATURES) w[i] = 10 * rng.randomDouble();
+  if(config.initial_weights) {
+    w = *config.initial_weights;
+  }else{
+    FOR(i, NUM_FEATURES) w[i] = config.hyper.init_scale * rng.randomDouble();
+  }
   
   vector<f64> m(NUM_FEATURES, 0.0);
   vector<f64> v(NUM_FEATURES, 0.0);
-  f64 alpha0 = 1;
+  f64 alpha0 = config.hyper.alpha0;
   f64 eps = 1e-8;
-  f64 beta1 = 0.9, beta2 = 0.999;
-  f64 lambda = 1e-7;
+  f64 beta1 = config.hyper.beta1, beta2 = config.hyper.beta2;
+  f64 lambda = config.hyper.lambda;
+  i32 minibatch_size = config.hyper.batch_size;
+  runtime_assert(minibatch_size > 0 && samples.size() > (u64)minibatch_size);
   
-  vector<training_sample> batch_samples(BATCH_SIZE);
+  // minibatches are lists of sample indices, gradients are accumulated
+  // in per-thread buffers allocated once
+  vector<u64> batch_indices(minibatch_size);
+  i32 num_threads = config.training_threads ? config.training_threads : omp_get_max_threads();
+  vector<gradient_buffer> L_gs(num_threads);
+  for(auto &L_g : L_gs) L_g.g.fill(0.0);
+
+  timer timer_training;
   
   FOR(iter, config.training_iters) {
     f64 alpha = alpha0 * pow(1e-1, 1.0 * iter / config.training_iters);
 
     bool whole_batch = iter > ((i32)config.training_iters - 64);
-    i32 batch_size = whole_batch ? samples.size() : BATCH_SIZE;
+    i32 batch_size = whole_batch ? samples.size() : minibatch_size;
 
-    if(whole_batch) {
-      batch_samples = samples;
-    }else{
-#pragma omp parallel for schedule(static, 512)
-      FOR(i, BATCH_SIZE) {
-        batch_samples[i] = rng.sample(samples);
+    if(!whole_batch) {
+      // one uniform index per stratum of the sample store: the batch is
+      // sorted, so the store is visited in order
+      u64 num_samples = samples.size();
+#pragma omp parallel for schedule(static, 512) num_threads(num_threads)
+      FOR(i, minibatch_size) {
+        batch_indices[i] = (i * num_samples + rng.random64(num_samples)) / minibatch_size;
       }
     }
     
     // compute gradients
-    vector<f64> g(NUM_FEATURES);
+    weights_vec g;
     f64 total_loss = 0;
-#pragma omp parallel
+#pragma omp parallel num_threads(num_threads) reduction(+:total_loss)
     {
-      vector<f64> L_g(NUM_FEATURES);
-      f64 L_total_loss = 0;
-
-#pragma omp for
-      FOR(isample, batch_size) {
-        auto const& sample = batch_samples[isample];
-        f64 value = 0.0;
-        FOR(i, NUM_FEATURES) {
-          value += sample.features[i] * w[i];
-        }
-        value = tanh(value);
-        f64 derivative = 1-value*value;
-
-        L_total_loss += value;
+      auto &L_g = L_gs[omp_get_thread_num()].g;
 
-        FOR(i, NUM_FEATURES) {
-          L_g[i] += sample.features[i] * derivative;
-        }
+#pragma omp for schedule(static)
+      FOR(i, batch_size) {
+        u64 isample = whole_batch ? i : batch_indices[i];
+        total_loss += sample_gradient(samples, isample, w, L_g);
       }
-
-#pragma omp critical
-      {
-        FOR(i, NUM_FEATURES) g[i] += L_g[i];
-        total_loss += L_total_loss;
+    }
+    FOR(i, NUM_FEATURES) {
+      g[i] = 0;
+      for(auto &L_g : L_gs) {
+        g[i] += L_g.g[i];
+        L_g.g[i] = 0;
       }
     }
     total_loss /= batch_size;
@@ -191,18 +403,18 @@ void update_weights(training_config const& config,
       max_delta = max(max_delta, abs(delta));
     }
     FOR(i, NUM_FEATURES) w[i] = max(w[i], 0.0);
-    w[dist_feature_key[0][0]] = 0;
-    w[nei_feature_key[0]] = 0;
+    w[feature_keys->dist[0][0]] = 0;
+    w[feature_keys->nei[0]] = 0;
 
-    FOR(u, puzzle.n) {
-      FOR(v, u+1) if(u+v < puzzle.n) {
-        if(u > 0 && v < u) w[dist_feature_key[u][v]] = max(w[dist_feature_key[u][v]], w[dist_feature_key[u-1][v]]);
-        if(v > 0) w[dist_feature_key[u][v]] = max(w[dist_feature_key[u][v]], w[dist_feature_key[u][v-1]]);
+    FOR(u, puzzle->n) {
+      FOR(v, u+1) if(u+v < puzzle->n) {
+        if(u > 0 && v < u) w[feature_keys->dist[u][v]] = max(w[feature_keys->dist[u][v]], w[feature_keys->dist[u-1][v]]);
+        if(v > 0) w[feature_keys->dist[u][v]] = max(w[feature_keys->dist[u][v]], w[feature_keys->dist[u][v-1]]);
       }
     }
     
     // printing
-    if(iter % 100 == 99 || whole_batch) {
+    if(config.print_training && (iter % 100 == 99 || whole_batch)) {
       cerr
         << "time = " << setw(4) << (iter+1)
         << ", lr = " << fixed << setprecision(6) << alpha
@@ -211,38 +423,177 @@ void update_weights(training_config const& config,
         << endl;
     }
   }
- 
-  {
+
+  if(config.print_training) {
+    cerr
+      << "iters/s = " << setprecision(2) << fixed
+      << config.training_iters / timer_training.elapsed()
+      << endl;
+
     cerr << "Values" << endl;
     cerr << "DIST:" << endl;
-    FOR(u, puzzle.n) {
-      FOR(v, u+1) if(u+v < puzzle.n) {
+    FOR(u, puzzle->n) {
+      FOR(v, u+1) if(u+v < puzzle->n) {
         cerr << setw(5) << setprecision(2) << fixed
-             << w[dist_feature_key[u][v]] << " ";
+             << w[feature_keys->dist[u][v]] << " ";
       }
       cerr << endl;
     }
     cerr << "NEI:" << endl;
     FOR(u, bit(6)) {
         cerr << setw(5) << setprecision(2) << fixed
-             << w[nei_feature_key[u]] << " ";
+             << w[feature_keys->nei[u]] << " ";
     }
     cerr << endl;
   }
 
   if(!config.output.empty()) {
-    ofstream os(config.output);
-    runtime_assert(os.good());
-    os.write((char*)&w, sizeof(weights_vec));
+    save_weights(config.output, weights_file {
+        .n = puzzle->n,
+        .gather_width = config.gather_width,
+        .gather_count = config.gather_count,
+        .features_save_probability = config.features_save_probability,
+        .training_iters = config.training_iters,
+        .num_samples = samples.size(),
+        .w = w,
+      });
   }
 
-  weights.from_weights(w);
+  return w;
 }
 
 void training_loop(training_config const& config) {
+  if(!config.samples.empty()) {
+    training_sample_store samples;
+    load_samples(config.samples, samples);
+    weights->from_weights(update_weights(config, samples));
+    return;
+  }
+
+  // each step starts from the weights of the previous one
+  auto step_config = config;
   FOR(step, config.steps) {
-    auto samples = gather_samples(config);
-    runtime_assert(samples.size() > BATCH_SIZE);
-    update_weights(config, samples);
+    training_sample_store samples;
+    if(config.mem_budget > 0) {
+      // The samples are streamed to a file while the searches hold the
+      // budget, and loaded once the searches are freed.
+      auto filename = filesystem::temp_directory_path() /
+        ("samples-" + to_string(getpid()) + "-" + to_string(step));
+      {
+        training_sample_writer writer(filename);
+        gather_samples(step_config, &writer);
+      }
+      load_samples(filename, samples);
+      filesystem::remove(filename);
+    }else{
+      samples = gather_samples(step_config);
+    }
+    step_config.initial_weights = update_weights(step_config, samples);
+    weights->from_weights(*step_config.initial_weights);
+  }
+}
+
+void sweep_hyperparams(training_config const& config, sweep_config const& sweep) {
+  runtime_assert(!config.samples.empty());
+  runtime_assert(!sweep.hypers.empty());
+
+  training_sample_store samples, train_samples, holdout_samples;
+  load_samples(config.samples, samples);
+  { RNG split_rng(0);
+    FOR(i, samples.size()) {
+      if(split_rng.randomDouble() < sweep.holdout) holdout_samples.add(samples, i);
+      else train_samples.add(samples, i);
+    }
+  }
+  samples = training_sample_store();
+  runtime_assert(train_samples.size() > 0 && holdout_samples.size() > 0);
+
+  cerr
+    << "sweep: " << sweep.hypers.size() << " configurations"
+    << ", " << train_samples.size() << " training samples"
+    << ", " << holdout_samples.size() << " held-out samples"
+    << endl;
+
+  // train the configurations in parallel
+  i32 num_configs = sweep.hypers.size();
+  i32 max_threads = omp_get_max_threads();
+  i32 num_parallel = min(num_configs, max_threads);
+  omp_set_max_active_levels(2);
+
+  vector<weights_vec> ws(num_configs);
+  auto tables = solver_tables::current();
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_parallel)
+  FOR(iconfig, num_configs) {
+    tables.bind();
+    auto hyper_config = config;
+    hyper_config.hyper = sweep.hypers[iconfig];
+    hyper_config.training_threads = max(1, max_threads / num_parallel);
+    hyper_config.print_training = false;
+    hyper_config.output = "";
+    ws[iconfig] = update_weights(hyper_config, train_samples);
+  }
+
+  // held-out pairwise ranking accuracy: X1 should have the lower value
+  vector<f64> accuracies(num_configs);
+  FOR(iconfig, num_configs) {
+    auto const& w = ws[iconfig];
+    f64 correct = 0;
+#pragma omp parallel for reduction(+:correct)
+    FOR(i, holdout_samples.size()) {
+      f64 value = 0;
+      for(u64 j = holdout_samples.offsets[i]; j < holdout_samples.offsets[i+1]; ++j) {
+        value += holdout_samples.values[j] * w[holdout_samples.keys[j]];
+      }
+      correct += value < 0 ? 1.0 : value == 0 ? 0.5 : 0.0;
+    }
+    accuracies[iconfig] = correct / holdout_samples.size();
+  }
+
+  // short beam searches
+  vector<evaluate_result> results(num_configs);
+  FOR(iconfig, num_configs) {
+    weights->from_weights(ws[iconfig]);
+    results[iconfig] = evaluate_current_weights(evaluate_config {
+        .weights = {},
+        .width = sweep.eval_width,
+        .num_seeds = sweep.eval_seeds,
+        .first_seed = 0,
+        .threads_per_search = 0,
+      });
+  }
+
+  vector<i32> order(num_configs);
+  iota(all(order), 0);
+  sort(all(order), [&](i32 a, i32 b) {
+    return mt(results[a].failures, results[a].mean, -accuracies[a]) <
+      mt(results[b].failures, results[b].mean, -accuracies[b]);
+  });
+
+  cout << "rank alpha0 beta1 beta2 lambda batch init accuracy mean std failures" << endl;
+  FOR(irank, num_configs) {
+    i32 i = order[irank];
+    auto const& h = sweep.hypers[i];
+    cout
+      << irank+1 << ' ' << setprecision(6) << defaultfloat
+      << h.alpha0 << ' ' << h.beta1 << ' ' << h.beta2 << ' '
+      << h.lambda << ' ' << h.batch_size << ' ' << h.init_scale << ' '
+      << setprecision(4) << fixed << accuracies[i] << ' '
+      << setprecision(2) << fixed << results[i].mean << ' ' << results[i].std << ' '
+      << results[i].failures
+      << endl;
+  }
+
+  auto const& best = ws[order[0]];
+  weights->from_weights(best);
+  if(!config.output.empty()) {
+    save_weights(config.output, weights_file {
+        .n = puzzle->n,
+        .gather_width = config.gather_width,
+        .gather_count = config.gather_count,
+        .features_save_probability = config.features_save_probability,
+        .training_iters = config.training_iters,
+        .num_samples = train_samples.size(),
+        .w = best,
+      });
   }
 }
@@ -3,31 +3,91 @@
 #include "eval.hpp"
 #include <omp.h>
 
+struct training_hyperparams {
+  f64 alpha0 = 1;
+  f64 beta1 = 0.9;
+  f64 beta2 = 0.999;
+  f64 lambda = 1e-7;
+  u32 batch_size = 1<<16;
+  f64 init_scale = 10; // random initial weights are in [0, init_scale)
+};
+
 struct training_config {
   u32   steps;
   bool   print;
   u32    gather_width;
   u32    gather_count;
+  u32    gather_threads;
+  u64    mem_budget; // bytes, 0 for no limit
   f32    features_save_probability;
+  bool   features_save_hard = false;
   u32   training_iters;
+  string samples;
   string output;
+  optional<weights_vec> initial_weights; // warm start, random if empty
+
+  training_hyperparams hyper = {};
+  u32  training_threads = 0; // 0 for omp_get_max_threads()
+  bool print_training = true;
 };
 
-struct training_sample {
-  features_vec features;
+// A training sample is X1 - X2, where X1 should be ranked better than X2.
+// These differences are mostly zero, so samples are stored sparsely:
+// sample i has the nonzero features keys[j], values[j] for offsets[i] <= j < offsets[i+1].
+struct training_sample_store {
+  vector<u64> offsets = {0};
+  vector<u8>  keys;
+  vector<i16> values;
+
+  u64 size() const { return offsets.size() - 1; }
 
-  training_sample(){}
-  training_sample(features_vec const& v1, features_vec const& v2) {
-    FOR(i, NUM_FEATURES) features[i] = v1[i] - v2[i];
-  }
+  void add(features_vec const& v1, features_vec const& v2);
+  void add(training_sample_store const& other, u64 isample);
+  void append(training_sample_store const& other);
+  void clear();
+
+  u64 memory_bytes() const;
 };
 
-vector<training_sample> gather_samples
-(training_config const& config);
+static_assert(MAX_SIZE <= numeric_limits<i16>::max());
+
+// Chunked binary sample files:
+//   header: magic "BALTSMP1", n (i32), NUM_FEATURES (u32)
+//   chunk:  num_samples (u32), num_entries (u64),
+//           sizes (u8[num_samples]), keys (u8[num_entries]), values (i16[num_entries])
+struct training_sample_writer {
+  ofstream os;
+  u64 num_samples = 0;
+  u64 num_bytes = 0;
+
+  training_sample_writer(string const& filename);
+  void write(training_sample_store const& chunk);
+};
+
+void load_samples
+(string const& filename,
+ training_sample_store& samples);
+
+training_sample_store gather_samples
+(training_config const& config,
+ training_sample_writer* writer = nullptr);
 
-void update_weights
+weights_vec update_weights
 (training_config const& config,
- vector<training_sample> const& samples);
+ training_sample_store const& samples);
 
 void training_loop
 (training_config const& config);
+
+struct sweep_config {
+  vector<training_hyperparams> hypers;
+  f32 holdout;     // fraction of the samples used for scoring
+  u32 eval_width;  // width of the scoring beam searches
+  u32 eval_seeds;  // number of scoring beam searches
+};
+
+// Trains every set of hyperparameters on the samples of config.samples,
+// scores them and saves the best weights to config.output.
+void sweep_hyperparams
+(training_config const& config,
+ sweep_config const& sweep);